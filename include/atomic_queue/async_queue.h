@@ -0,0 +1,216 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_ASYNC_QUEUE_H_INCLUDED
+#define ATOMIC_QUEUE_ASYNC_QUEUE_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#ifndef __cpp_impl_coroutine
+#error "atomic_queue/async_queue.h requires C++20 coroutines."
+#endif
+
+#include "atomic_queue.h"
+
+#include <coroutine>
+#include <utility>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Adds co_await async_pop() and co_await async_push(element) to AtomicQueue2 or AtomicQueueB2, so that coroutines wait for
+// elements and free slots suspended rather than blocking their threads or polling try_pop/try_push, e.g.:
+//
+//     AsyncQueue<AtomicQueue2<Message, 1024>> q;
+//     Message m = co_await q.async_pop();
+//     co_await q.async_push(m);
+//
+// A suspended awaiter is linked into a lock-free stack of poppers or pushers. The thread which pushes an element (pops one) next
+// takes the stack of poppers (pushers) off, pops the elements for (pushes the elements of) the awaiters while try_pop
+// (try_push) succeeds, links the remaining awaiters back and resumes the served ones inline. Resume on the executor of choice
+// after co_await, if that matters.
+//
+// push, pop, try_push and try_pop serve the awaiters too, at the cost of a full fence and a load of the other stack each. Other
+// functions of Queue, e.g. emplace or push_n, do not, mixing them with the awaiters loses wake-ups. Queue must not be an SPSC
+// one, because the serving thread pops and pushes on behalf of the awaiters. The queue must not be destroyed while there are
+// suspended awaiters.
+template<class Queue>
+class AsyncQueue : public Queue {
+public:
+    using T = typename Queue::value_type;
+    using value_type = T;
+
+private:
+    struct Waiter {
+        Waiter* next = nullptr;
+        std::coroutine_handle<> handle;
+        T element = {}; // The element popped for the awaiter, or the element to push.
+    };
+
+    // A waiter belongs to the thread which has taken it off its stack, only that thread resumes it.
+    alignas(CACHE_LINE_SIZE) std::atomic<Waiter*> poppers_ = {};
+    alignas(CACHE_LINE_SIZE) std::atomic<Waiter*> pushers_ = {};
+
+    static void link(std::atomic<Waiter*>& waiters, Waiter* first, Waiter* last) noexcept {
+        Waiter* head = waiters.load(X);
+        do
+            last->next = head;
+        while(!waiters.compare_exchange_weak(head, first, R, X));
+    }
+
+    // Serves the waiters of the stack while serve_one succeeds and moves them onto ready. Returns whether it has served any.
+    template<class ServeOne, class More>
+    bool serve(std::atomic<Waiter*>& waiters, ServeOne serve_one, More more, Waiter*& ready) noexcept {
+        bool served = false;
+        while(waiters.load(X)) {
+            Waiter* w = waiters.exchange(nullptr, A);
+            for(; w && serve_one(*w); served = true) {
+                Waiter* next = w->next;
+                w->next = ready;
+                ready = w;
+                w = next;
+            }
+            if(w) {
+                Waiter* last = w;
+                while(last->next)
+                    last = last->next;
+                link(waiters, w, last);
+                // Either this thread sees the elements (slots) which arrived after serve_one failed, or the thread which
+                // pushed (popped) them sees the waiters linked back.
+                std::atomic_thread_fence(C);
+                if(!more())
+                    break;
+            }
+        }
+        return served;
+    }
+
+    void wake() noexcept {
+        auto pop_for = [this](Waiter& w) { return this->Queue::try_pop(w.element); };
+        auto push_of = [this](Waiter& w) { return this->Queue::try_push(std::move(w.element)); };
+        auto not_empty = [this]() { return !this->was_empty(); };
+        auto not_full = [this]() { return !this->was_full(); };
+
+        // Serving the poppers frees slots for the pushers, serving the pushers stores elements for the poppers.
+        Waiter* ready = nullptr;
+        for(bool served = true; served;) {
+            served = serve(poppers_, pop_for, not_empty, ready);
+            served |= serve(pushers_, push_of, not_full, ready);
+        }
+        while(ready) {
+            Waiter* next = ready->next;
+            ready->handle.resume(); // Destroys the waiter, eventually.
+            ready = next;
+        }
+    }
+
+    // Called after an element is pushed (popped), which may be the one the poppers (pushers) wait for.
+    void notify(std::atomic<Waiter*>& waiters) noexcept {
+        std::atomic_thread_fence(C);
+        if(ATOMIC_QUEUE_UNLIKELY(waiters.load(X) != nullptr))
+            wake();
+    }
+
+    // The waiter can be served and resumed by another thread as soon as it is linked, this function must not touch it after that.
+    template<class More>
+    void suspend(std::atomic<Waiter*>& waiters, Waiter& w, More more) noexcept {
+        link(waiters, &w, &w);
+        std::atomic_thread_fence(C);
+        if(more()) // Arrived after await_ready has failed and before the waiter was linked.
+            wake();
+    }
+
+    class PopAwaiter : Waiter {
+        AsyncQueue& q_;
+
+    public:
+        explicit PopAwaiter(AsyncQueue& q) noexcept
+            : q_(q) {}
+
+        bool await_ready() noexcept {
+            return q_.try_pop(this->element);
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            this->handle = handle;
+            AsyncQueue& q = q_;
+            q.suspend(q.poppers_, *this, [&q]() { return !q.was_empty(); });
+        }
+
+        T await_resume() noexcept {
+            return std::move(this->element);
+        }
+    };
+
+    class PushAwaiter : Waiter {
+        AsyncQueue& q_;
+
+    public:
+        template<class U>
+        PushAwaiter(AsyncQueue& q, U&& element) noexcept
+            : q_(q) {
+            this->element = std::forward<U>(element);
+        }
+
+        bool await_ready() noexcept {
+            return q_.try_push(std::move(this->element)); // Leaves the element intact when it fails.
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            this->handle = handle;
+            AsyncQueue& q = q_;
+            q.suspend(q.pushers_, *this, [&q]() { return !q.was_full(); });
+        }
+
+        void await_resume() noexcept {}
+    };
+
+public:
+    using Queue::Queue;
+
+    // co_await async_pop() returns the popped element.
+    PopAwaiter async_pop() noexcept {
+        return PopAwaiter{*this};
+    }
+
+    template<class U>
+    PushAwaiter async_push(U&& element) noexcept {
+        return PushAwaiter{*this, std::forward<U>(element)};
+    }
+
+    template<class U>
+    bool try_push(U&& element) noexcept {
+        if(!Queue::try_push(std::forward<U>(element)))
+            return false;
+        notify(poppers_);
+        return true;
+    }
+
+    bool try_pop(T& element) noexcept {
+        if(!Queue::try_pop(element))
+            return false;
+        notify(pushers_);
+        return true;
+    }
+
+    template<class U>
+    void push(U&& element) noexcept {
+        Queue::push(std::forward<U>(element));
+        notify(poppers_);
+    }
+
+    T pop() noexcept {
+        T element = Queue::pop();
+        notify(pushers_);
+        return element;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_ASYNC_QUEUE_H_INCLUDED
@@ -5,12 +5,17 @@
 // Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
 
 #include "defs.h"
+#include "queue_stats.h"
+#include "wait_strategy.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <iterator>
 #include <memory>
+#include <new>
+#include <type_traits>
 #include <utility>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -21,6 +26,18 @@ using std::uint32_t;
 using std::uint64_t;
 using std::uint8_t;
 
+// How AtomicQueue2 and AtomicQueueB2 lay out the slot states and elements in memory.
+enum class SlotLayout {
+    SEPARATE,    // An array of states and an array of elements. A push or pop touches the cache lines of both.
+    INTERLEAVED, // An array of {state, element}. A push or pop touches one cache line for small elements.
+    PADDED       // An array of {state, element}, each aligned to a cache line. No false sharing between neighbouring slots.
+};
+
+// Makes AtomicQueueB and AtomicQueueB2 constructors use the size as is, rather than round it up to a power of 2. The ring-buffer
+// index is then mapped into the array with a multiply-shift, rather than a binary and.
+struct ArbitraryCapacity {};
+constexpr ArbitraryCapacity arbitrary_capacity{};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 namespace details {
@@ -67,6 +84,12 @@ constexpr unsigned remap_index<0>(unsigned index) noexcept {
     return index;
 }
 
+// For 64-bit indexes. The shuffled bits are always in the lower 32 bits.
+template<int BITS>
+constexpr uint64_t remap_index(uint64_t index) noexcept {
+    return index >> 32 << 32 | remap_index<BITS>(static_cast<unsigned>(index));
+}
+
 template<int BITS, class T>
 constexpr T& map(T* elements, unsigned index) noexcept {
     return elements[remap_index<BITS>(index)];
@@ -114,6 +137,75 @@ constexpr uint64_t round_up_to_power_of_2(uint64_t a) noexcept {
     return increment(or_equal(decrement(a), 1, 2, 4, 8, 16, 32));
 }
 
+// Maps a ring-buffer index into [0, size). With a power of 2 size that is a binary and. Otherwise, a division is replaced with
+// Lemire's multiply-shift fast modulo: ((2^64 / size + 1) * index mod 2^64) * size / 2^64, exact for all 32-bit operands.
+//
+// With a size which does not divide 2^32 the slot sequence restarts from 0 when the index wraps around, once every 2^32
+// operations. The slot states make that harmless: a slot claimed for two indices at once is used by them in turn.
+class FastModulo {
+    uint64_t multiplier_ = 0; // 0 for a power of 2 size.
+    unsigned size_ = 0;
+
+public:
+    FastModulo() noexcept = default;
+
+    explicit FastModulo(unsigned size) noexcept
+        : multiplier_(size & (size - 1) ? UINT64_C(0xffffffffffffffff) / size + 1 : 0)
+        , size_(size) {}
+
+    unsigned operator()(unsigned index) const noexcept {
+        if(ATOMIC_QUEUE_LIKELY(!multiplier_))
+            return index & (size_ - 1);
+#ifdef __SIZEOF_INT128__
+        uint64_t const fraction = multiplier_ * index;
+        return static_cast<unsigned>((static_cast<unsigned __int128>(fraction) * size_) >> 64);
+#else
+        return index % size_;
+#endif
+    }
+};
+
+// FastModulo for 64-bit indexes. The multiply-shift would need 192-bit products, a non-power of 2 size uses a division instead.
+// 64-bit indexes never wrap around.
+class FastModulo64 {
+    uint64_t mask_ = 0; // size - 1 for a power of 2 size, otherwise 0.
+    uint64_t size_ = 0;
+
+public:
+    FastModulo64() noexcept = default;
+
+    explicit FastModulo64(uint64_t size) noexcept
+        : mask_(size & (size - 1) ? 0 : size - 1)
+        , size_(size) {}
+
+    uint64_t operator()(uint64_t index) const noexcept {
+        return ATOMIC_QUEUE_LIKELY(mask_ || size_ == 1) ? index & mask_ : index % size_;
+    }
+};
+
+// Maps a ring-buffer index into the array index of AtomicQueueB and AtomicQueueB2: FastModulo, then remap_index for the indices
+// in the whole blocks of 2^(BITS*2) elements. The indices in the last partial block are not remapped, because remap_index is a
+// permutation of a whole block only. This way a size of any value does not need rounding up.
+template<int BITS, class Index = unsigned>
+class RingIndex {
+    using Modulo = typename std::conditional<sizeof(Index) == sizeof(uint64_t), FastModulo64, FastModulo>::type;
+
+    Modulo modulo_;
+    Index remapped_ = 0; // The size rounded down to a multiple of the block.
+
+public:
+    RingIndex() noexcept = default;
+
+    explicit RingIndex(Index size) noexcept
+        : modulo_(size)
+        , remapped_(size & ~((Index{1} << (BITS * 2)) - 1)) {}
+
+    Index operator()(Index index) const noexcept {
+        index = modulo_(index);
+        return ATOMIC_QUEUE_LIKELY(index < remapped_) ? remap_index<BITS>(index) : index;
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<class T>
@@ -125,23 +217,214 @@ constexpr T nil() noexcept {
 }
 
 template<class T>
-inline void destroy_n(T* p, unsigned n) noexcept {
+inline void destroy_n(T* p, size_t n) noexcept {
     for(auto q = p + n; p != q;)
         (p++)->~T();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// A slot of the INTERLEAVED and PADDED layouts.
+template<class T, SlotLayout LAYOUT>
+struct Slot {
+    std::atomic<unsigned char> state;
+    T element;
+};
+
+template<class T>
+struct alignas(CACHE_LINE_SIZE) Slot<T, SlotLayout::PADDED> {
+    std::atomic<unsigned char> state;
+    T element;
+};
+
+// The number of slots per cache line for remap_index to spread across cache lines. 0 disables the shuffle, which is the case
+// for slots larger than a cache line. The SEPARATE layout shuffles by the states, the elements follow the states.
+template<class T, SlotLayout LAYOUT>
+struct SlotsPerCacheLine {
+    static constexpr size_t value = CACHE_LINE_SIZE / sizeof(Slot<T, LAYOUT>);
+};
+
+template<class T>
+struct SlotsPerCacheLine<T, SlotLayout::SEPARATE> {
+    static constexpr size_t value = CACHE_LINE_SIZE / sizeof(std::atomic<unsigned char>);
+};
+
+// The slots of AtomicQueue2.
+template<class T, unsigned SIZE, SlotLayout LAYOUT>
+struct SlotArray {
+    alignas(CACHE_LINE_SIZE) Slot<T, LAYOUT> slots[SIZE] = {};
+
+    std::atomic<unsigned char>& state(unsigned index) noexcept {
+        return slots[index].state;
+    }
+
+    T& element(unsigned index) noexcept {
+        return slots[index].element;
+    }
+};
+
+template<class T, unsigned SIZE>
+struct SlotArray<T, SIZE, SlotLayout::SEPARATE> {
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned char> states[SIZE] = {};
+    alignas(CACHE_LINE_SIZE) T elements[SIZE] = {};
+
+    std::atomic<unsigned char>& state(unsigned index) noexcept {
+        return states[index];
+    }
+
+    T& element(unsigned index) noexcept {
+        return elements[index];
+    }
+};
+
+inline unsigned char* align_up(unsigned char* p, size_t alignment) noexcept {
+    return p + (-reinterpret_cast<uintptr_t>(p) & (alignment - 1));
+}
+
+// The slots of AtomicQueueB2 in one allocation of storage_size(size) bytes. The storage is aligned here, so that the allocator
+// need not support over-aligned types.
+template<class T, SlotLayout LAYOUT>
+class SlotStorage {
+    using Slot = details::Slot<T, LAYOUT>;
+
+    unsigned char* storage_ = nullptr;
+    Slot* slots_ = nullptr;
+
+public:
+    static constexpr size_t storage_size(size_t size) noexcept {
+        return size * sizeof(Slot) + alignof(Slot) - 1;
+    }
+
+    SlotStorage() noexcept = default;
+
+    SlotStorage(SlotStorage&& b) noexcept
+        : storage_(std::exchange(b.storage_, nullptr))
+        , slots_(std::exchange(b.slots_, nullptr)) {}
+
+    template<class A>
+    void construct(unsigned char* storage, size_t size, A& allocator) {
+        storage_ = storage;
+        slots_ = reinterpret_cast<Slot*>(align_up(storage, alignof(Slot)));
+        for(auto q = slots_, r = slots_ + size; q < r; ++q) {
+            new(&q->state) std::atomic<unsigned char>{0};
+            std::allocator_traits<A>::construct(allocator, &q->element);
+        }
+    }
+
+    // Returns the storage to deallocate.
+    template<class A>
+    unsigned char* destroy(size_t size, A& allocator) noexcept {
+        for(auto q = slots_, r = slots_ + size; q < r; ++q) {
+            std::allocator_traits<A>::destroy(allocator, &q->element);
+            q->state.~atomic();
+        }
+        slots_ = nullptr;
+        return std::exchange(storage_, nullptr);
+    }
+
+    explicit operator bool() const noexcept {
+        return storage_;
+    }
+
+    void swap(SlotStorage& b) noexcept {
+        std::swap(storage_, b.storage_);
+        std::swap(slots_, b.slots_);
+    }
+
+    std::atomic<unsigned char>& state(size_t index) noexcept {
+        return slots_[index].state;
+    }
+
+    T& element(size_t index) noexcept {
+        return slots_[index].element;
+    }
+};
+
+template<class T>
+class SlotStorage<T, SlotLayout::SEPARATE> {
+    using AtomicState = std::atomic<unsigned char>;
+
+    unsigned char* storage_ = nullptr;
+    AtomicState* states_ = nullptr;
+    T* elements_ = nullptr;
+
+public:
+    // Each array starts on a new cache line.
+    static constexpr size_t storage_size(size_t size) noexcept {
+        static_assert(alignof(T) <= CACHE_LINE_SIZE, "Over-aligned T.");
+        return size * sizeof(AtomicState) + size * sizeof(T) + 2 * CACHE_LINE_SIZE;
+    }
+
+    SlotStorage() noexcept = default;
+
+    SlotStorage(SlotStorage&& b) noexcept
+        : storage_(std::exchange(b.storage_, nullptr))
+        , states_(std::exchange(b.states_, nullptr))
+        , elements_(std::exchange(b.elements_, nullptr)) {}
+
+    template<class A>
+    void construct(unsigned char* storage, size_t size, A& allocator) {
+        storage_ = storage;
+        states_ = reinterpret_cast<AtomicState*>(align_up(storage, CACHE_LINE_SIZE));
+        elements_ = reinterpret_cast<T*>(align_up(reinterpret_cast<unsigned char*>(states_ + size), CACHE_LINE_SIZE));
+        std::uninitialized_fill_n(states_, size, 0);
+        for(auto q = elements_, r = elements_ + size; q < r; ++q)
+            std::allocator_traits<A>::construct(allocator, q);
+    }
+
+    // Returns the storage to deallocate.
+    template<class A>
+    unsigned char* destroy(size_t size, A& allocator) noexcept {
+        for(auto q = elements_, r = elements_ + size; q < r; ++q)
+            std::allocator_traits<A>::destroy(allocator, q);
+        destroy_n(states_, size);
+        states_ = nullptr;
+        elements_ = nullptr;
+        return std::exchange(storage_, nullptr);
+    }
+
+    explicit operator bool() const noexcept {
+        return storage_;
+    }
+
+    void swap(SlotStorage& b) noexcept {
+        std::swap(storage_, b.storage_);
+        std::swap(states_, b.states_);
+        std::swap(elements_, b.elements_);
+    }
+
+    std::atomic<unsigned char>& state(size_t index) noexcept {
+        return states_[index];
+    }
+
+    T& element(size_t index) noexcept {
+        return elements_[index];
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 } // namespace details
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template<class Derived>
+template<class Queue, unsigned BLOCK>
+class ConsumerToken;
+
+// Index is the type of the head and tail indexes, unsigned or uint64_t. The full and empty checks take the difference of the
+// indexes as a signed number, which limits the capacity to the maximum of that signed type.
+template<class Derived, class Index = unsigned>
 class AtomicQueueCommon {
+    static_assert(std::is_same<Index, unsigned>::value || std::is_same<Index, uint64_t>::value, "Index must be unsigned or uint64_t.");
+    using Difference = typename std::make_signed<Index>::type;
+
+    template<class Queue, unsigned BLOCK>
+    friend class ConsumerToken;
+
 protected:
     // Put these on different cache lines to avoid false sharing between readers and writers.
-    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> head_ = {};
-    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> tail_ = {};
+    alignas(CACHE_LINE_SIZE) std::atomic<Index> head_ = {};
+    alignas(CACHE_LINE_SIZE) std::atomic<Index> tail_ = {};
 
     // The special member functions are not thread-safe.
 
@@ -158,8 +441,8 @@ protected:
     }
 
     void swap(AtomicQueueCommon& b) noexcept {
-        unsigned h = head_.load(X);
-        unsigned t = tail_.load(X);
+        Index h = head_.load(X);
+        Index t = tail_.load(X);
         head_.store(b.head_.load(X), X);
         tail_.store(b.tail_.load(X), X);
         b.head_.store(h, X);
@@ -168,26 +451,37 @@ protected:
 
     template<class T, T NIL>
     static T do_pop_atomic(std::atomic<T>& q_element) noexcept {
+        using Wait = typename Derived::wait_strategy;
+        using Stats = typename Derived::stats_policy;
         if(Derived::spsc_) {
-            for(;;) {
-                T element = q_element.load(A);
-                if(ATOMIC_QUEUE_LIKELY(element != NIL)) {
-                    q_element.store(NIL, X);
-                    return element;
-                }
-                if(Derived::maximize_throughput_)
-                    spin_loop_pause();
+            T element = q_element.load(A);
+            if(ATOMIC_QUEUE_UNLIKELY(element == NIL)) {
+                ATOMIC_QUEUE_PROBE2(spin_wait, &q_element, false);
+                Wait wait;
+                do {
+                    Stats::spin();
+                    wait.wait_while(q_element, NIL);
+                } while((element = q_element.load(A)) == NIL);
             }
+            q_element.store(NIL, X);
+            Wait::notify(q_element);
+            ATOMIC_QUEUE_PROBE1(consume, &q_element);
+            return element;
         }
         else {
-            for(;;) {
+            for(Wait wait;;) {
                 T element = q_element.exchange(NIL, A); // (2) The store to wait for.
-                if(ATOMIC_QUEUE_LIKELY(element != NIL))
+                if(ATOMIC_QUEUE_LIKELY(element != NIL)) {
+                    Wait::notify(q_element);
+                    ATOMIC_QUEUE_PROBE1(consume, &q_element);
                     return element;
+                }
+                ATOMIC_QUEUE_PROBE2(spin_wait, &q_element, false);
                 // Do speculative loads while busy-waiting to avoid broadcasting RFO messages.
-                do
-                    spin_loop_pause();
-                while(Derived::maximize_throughput_ && q_element.load(X) == NIL);
+                do {
+                    Stats::spin();
+                    wait.wait_while(q_element, NIL);
+                } while(Derived::maximize_throughput_ && q_element.load(X) == NIL);
             }
         }
     }
@@ -195,116 +489,202 @@ protected:
     template<class T, T NIL>
     static void do_push_atomic(T element, std::atomic<T>& q_element) noexcept {
         assert(element != NIL);
+        using Wait = typename Derived::wait_strategy;
+        using Stats = typename Derived::stats_policy;
+        Wait wait;
         if(Derived::spsc_) {
-            while(ATOMIC_QUEUE_UNLIKELY(q_element.load(X) != NIL))
-                if(Derived::maximize_throughput_)
-                    spin_loop_pause();
+            if(ATOMIC_QUEUE_UNLIKELY(q_element.load(X) != NIL)) {
+                ATOMIC_QUEUE_PROBE2(spin_wait, &q_element, true);
+                do {
+                    Stats::spin();
+                    wait.wait_until(q_element, NIL);
+                } while(q_element.load(X) != NIL);
+            }
             q_element.store(element, R);
         }
         else {
             for(T expected = NIL; ATOMIC_QUEUE_UNLIKELY(!q_element.compare_exchange_weak(expected, element, R, X)); expected = NIL) {
-                do
-                    spin_loop_pause(); // (1) Wait for store (2) to complete.
-                while(Derived::maximize_throughput_ && q_element.load(X) != NIL);
+                Stats::cas_failure();
+                ATOMIC_QUEUE_PROBE2(spin_wait, &q_element, true);
+                do {
+                    Stats::spin();
+                    wait.wait_until(q_element, NIL); // (1) Wait for store (2) to complete.
+                } while(Derived::maximize_throughput_ && q_element.load(X) != NIL);
             }
         }
+        Wait::notify(q_element);
+        ATOMIC_QUEUE_PROBE1(publish, &q_element);
+    }
+
+    // The number of slots, up to max, a batch push can claim.
+    unsigned free_slots(Index head, Index tail, unsigned max) const noexcept {
+        Difference size = static_cast<Difference>(static_cast<Derived const&>(*this).size_);
+        Difference free = size - std::max<Difference>(static_cast<Difference>(head - tail), 0); // tail_ can be greater than head_, see was_size.
+        return static_cast<unsigned>(std::min<Difference>(std::max<Difference>(free, 0), max));
+    }
+
+    // The number of elements, up to max, a batch pop can claim.
+    static unsigned used_slots(Index head, Index tail, unsigned max) noexcept {
+        return static_cast<unsigned>(std::min<Difference>(std::max<Difference>(static_cast<Difference>(head - tail), 0), max));
     }
 
     enum State : unsigned char { EMPTY, STORING, STORED, LOADING };
 
-    template<class T>
-    static T do_pop_any(std::atomic<unsigned char>& state, T& q_element) noexcept {
+    // Calls load() on the slot once it is STORED, then releases the slot.
+    template<class F>
+    static auto do_load_any(std::atomic<unsigned char>& state, F&& load) noexcept -> decltype(load()) {
+        using Wait = typename Derived::wait_strategy;
+        struct Release {
+            std::atomic<unsigned char>& state;
+            ~Release() noexcept {
+                state.store(EMPTY, R);
+                Wait::notify(state);
+                ATOMIC_QUEUE_PROBE1(consume, &state);
+            }
+        };
+        using Stats = typename Derived::stats_policy;
+        Wait wait;
         if(Derived::spsc_) {
-            while(ATOMIC_QUEUE_UNLIKELY(state.load(A) != STORED))
-                if(Derived::maximize_throughput_)
-                    spin_loop_pause();
-            T element{std::move(q_element)};
-            state.store(EMPTY, R);
-            return element;
+            if(ATOMIC_QUEUE_UNLIKELY(state.load(A) != STORED)) {
+                ATOMIC_QUEUE_PROBE2(spin_wait, &state, false);
+                do {
+                    Stats::spin();
+                    wait.wait_until(state, static_cast<unsigned char>(STORED));
+                } while(state.load(A) != STORED);
+            }
+            Release release{state};
+            return load();
         }
         else {
             for(;;) {
                 unsigned char expected = STORED;
                 if(ATOMIC_QUEUE_LIKELY(state.compare_exchange_weak(expected, LOADING, A, X))) {
-                    T element{std::move(q_element)};
-                    state.store(EMPTY, R);
-                    return element;
+                    Release release{state};
+                    return load();
                 }
+                Stats::cas_failure();
+                ATOMIC_QUEUE_PROBE2(spin_wait, &state, false);
                 // Do speculative loads while busy-waiting to avoid broadcasting RFO messages.
-                do
-                    spin_loop_pause();
-                while(Derived::maximize_throughput_ && state.load(X) != STORED);
+                do {
+                    Stats::spin();
+                    wait.wait_until(state, static_cast<unsigned char>(STORED));
+                } while(Derived::maximize_throughput_ && state.load(X) != STORED);
             }
         }
     }
 
-    template<class U, class T>
-    static void do_push_any(U&& element, std::atomic<unsigned char>& state, T& q_element) noexcept {
+    // Calls store() on the slot once it is EMPTY, then publishes the slot.
+    template<class F>
+    static void do_store_any(std::atomic<unsigned char>& state, F&& store) noexcept {
+        using Wait = typename Derived::wait_strategy;
+        using Stats = typename Derived::stats_policy;
+        Wait wait;
         if(Derived::spsc_) {
-            while(ATOMIC_QUEUE_UNLIKELY(state.load(A) != EMPTY))
-                if(Derived::maximize_throughput_)
-                    spin_loop_pause();
-            q_element = std::forward<U>(element);
-            state.store(STORED, R);
+            if(ATOMIC_QUEUE_UNLIKELY(state.load(A) != EMPTY)) {
+                ATOMIC_QUEUE_PROBE2(spin_wait, &state, true);
+                do {
+                    Stats::spin();
+                    wait.wait_until(state, static_cast<unsigned char>(EMPTY));
+                } while(state.load(A) != EMPTY);
+            }
         }
         else {
             for(;;) {
                 unsigned char expected = EMPTY;
-                if(ATOMIC_QUEUE_LIKELY(state.compare_exchange_weak(expected, STORING, A, X))) {
-                    q_element = std::forward<U>(element);
-                    state.store(STORED, R);
-                    return;
-                }
+                if(ATOMIC_QUEUE_LIKELY(state.compare_exchange_weak(expected, STORING, A, X)))
+                    break;
+                Stats::cas_failure();
+                ATOMIC_QUEUE_PROBE2(spin_wait, &state, true);
                 // Do speculative loads while busy-waiting to avoid broadcasting RFO messages.
-                do
-                    spin_loop_pause();
-                while(Derived::maximize_throughput_ && state.load(X) != EMPTY);
+                do {
+                    Stats::spin();
+                    wait.wait_until(state, static_cast<unsigned char>(EMPTY));
+                } while(Derived::maximize_throughput_ && state.load(X) != EMPTY);
             }
         }
+        store();
+        state.store(STORED, R);
+        Wait::notify(state);
+        ATOMIC_QUEUE_PROBE1(publish, &state);
     }
 
-public:
     template<class T>
-    bool try_push(T&& element) noexcept {
-        auto head = head_.load(X);
+    static T do_pop_any(std::atomic<unsigned char>& state, T& q_element) noexcept {
+        return do_load_any(state, [&q_element]() { return T{std::move(q_element)}; });
+    }
+
+    template<class U, class T>
+    static void do_push_any(U&& element, std::atomic<unsigned char>& state, T& q_element) noexcept {
+        do_store_any(state, [&]() { q_element = std::forward<U>(element); });
+    }
+
+    // Destroys the element left in the slot by the previous pop and constructs the new one in its place.
+    template<class T, class... Args>
+    static void do_emplace_any(std::atomic<unsigned char>& state, T& q_element, Args&&... args) noexcept {
+        do_store_any(state, [&]() {
+            q_element.~T();
+            new(&q_element) T(std::forward<Args>(args)...);
+        });
+    }
+
+    // The element stays in the slot after f returns, unless f moves it out.
+    template<class T, class F>
+    static void do_consume_any(std::atomic<unsigned char>& state, T& q_element, F& f) noexcept {
+        do_load_any(state, [&]() { f(q_element); });
+    }
+
+    bool try_claim_head(Index& head) noexcept {
+        using Stats = typename Derived::stats_policy;
+        head = head_.load(X);
         if(Derived::spsc_) {
-            if(static_cast<int>(head - tail_.load(X)) >= static_cast<int>(static_cast<Derived&>(*this).size_))
+            if(static_cast<Difference>(head - tail_.load(X)) >= static_cast<Difference>(static_cast<Derived&>(*this).size_)) {
+                Stats::full();
                 return false;
+            }
             head_.store(head + 1, X);
         }
         else {
-            do {
-                if(static_cast<int>(head - tail_.load(X)) >= static_cast<int>(static_cast<Derived&>(*this).size_))
+            for(;;) { // This loop is not FIFO.
+                if(static_cast<Difference>(head - tail_.load(X)) >= static_cast<Difference>(static_cast<Derived&>(*this).size_)) {
+                    Stats::full();
                     return false;
-            } while(ATOMIC_QUEUE_UNLIKELY(!head_.compare_exchange_weak(head, head + 1, X, X))); // This loop is not FIFO.
+                }
+                if(ATOMIC_QUEUE_LIKELY(head_.compare_exchange_weak(head, head + 1, X, X)))
+                    break;
+                Stats::cas_failure();
+            }
         }
-
-        static_cast<Derived&>(*this).do_push(std::forward<T>(element), head);
+        ATOMIC_QUEUE_PROBE3(push_claim, this, head, 1u);
         return true;
     }
 
-    template<class T>
-    bool try_pop(T& element) noexcept {
-        auto tail = tail_.load(X);
+    bool try_claim_tail(Index& tail) noexcept {
+        using Stats = typename Derived::stats_policy;
+        tail = tail_.load(X);
         if(Derived::spsc_) {
-            if(static_cast<int>(head_.load(X) - tail) <= 0)
+            if(static_cast<Difference>(head_.load(X) - tail) <= 0) {
+                Stats::empty();
                 return false;
+            }
             tail_.store(tail + 1, X);
         }
         else {
-            do {
-                if(static_cast<int>(head_.load(X) - tail) <= 0)
+            for(;;) { // This loop is not FIFO.
+                if(static_cast<Difference>(head_.load(X) - tail) <= 0) {
+                    Stats::empty();
                     return false;
-            } while(ATOMIC_QUEUE_UNLIKELY(!tail_.compare_exchange_weak(tail, tail + 1, X, X))); // This loop is not FIFO.
+                }
+                if(ATOMIC_QUEUE_LIKELY(tail_.compare_exchange_weak(tail, tail + 1, X, X)))
+                    break;
+                Stats::cas_failure();
+            }
         }
-
-        element = static_cast<Derived&>(*this).do_pop(tail);
+        ATOMIC_QUEUE_PROBE3(pop_claim, this, tail, 1u);
         return true;
     }
 
-    template<class T>
-    void push(T&& element) noexcept {
-        unsigned head;
+    Index claim_head() noexcept {
+        Index head;
         if(Derived::spsc_) {
             head = head_.load(X);
             head_.store(head + 1, X);
@@ -313,11 +693,42 @@ public:
             constexpr auto memory_order = Derived::total_order_ ? std::memory_order_seq_cst : std::memory_order_relaxed;
             head = head_.fetch_add(1, memory_order); // FIFO and total order on Intel regardless, as of 2019.
         }
-        static_cast<Derived&>(*this).do_push(std::forward<T>(element), head);
+        ATOMIC_QUEUE_PROBE3(push_claim, this, head, 1u);
+        return head;
     }
 
-    auto pop() noexcept {
-        unsigned tail;
+    // Claims up to max indices of stored elements, rather than waiting for more. Returns the number of indices claimed.
+    unsigned try_claim_tail_n(Index& tail, unsigned max) noexcept {
+        using Stats = typename Derived::stats_policy;
+        tail = tail_.load(X);
+        unsigned count;
+        if(Derived::spsc_) {
+            if((count = used_slots(head_.load(X), tail, max)))
+                tail_.store(tail + count, X);
+        }
+        else {
+            for(;;) { // This loop is not FIFO.
+                if(!(count = used_slots(head_.load(X), tail, max)))
+                    break;
+                if(ATOMIC_QUEUE_LIKELY(tail_.compare_exchange_weak(tail, tail + count, X, X)))
+                    break;
+                Stats::cas_failure();
+            }
+        }
+        if(!count)
+            Stats::empty();
+        else
+            ATOMIC_QUEUE_PROBE3(pop_claim, this, tail, count);
+        return count;
+    }
+
+    // Pops the element of an index claimed by try_claim_tail_n.
+    auto pop_at(Index tail) noexcept {
+        return static_cast<Derived&>(*this).do_pop(tail);
+    }
+
+    Index claim_tail() noexcept {
+        Index tail;
         if(Derived::spsc_) {
             tail = tail_.load(X);
             tail_.store(tail + 1, X);
@@ -326,7 +737,150 @@ public:
             constexpr auto memory_order = Derived::total_order_ ? std::memory_order_seq_cst : std::memory_order_relaxed;
             tail = tail_.fetch_add(1, memory_order); // FIFO and total order on Intel regardless, as of 2019.
         }
-        return static_cast<Derived&>(*this).do_pop(tail);
+        ATOMIC_QUEUE_PROBE3(pop_claim, this, tail, 1u);
+        return tail;
+    }
+
+public:
+    using index_type = Index;
+
+    template<class T>
+    bool try_push(T&& element) noexcept {
+        Index head;
+        if(!try_claim_head(head))
+            return false;
+        static_cast<Derived&>(*this).do_push(std::forward<T>(element), head);
+        return true;
+    }
+
+    template<class T>
+    bool try_pop(T& element) noexcept {
+        Index tail;
+        if(!try_claim_tail(tail))
+            return false;
+        element = static_cast<Derived&>(*this).do_pop(tail);
+        return true;
+    }
+
+    template<class T>
+    void push(T&& element) noexcept {
+        static_cast<Derived&>(*this).do_push(std::forward<T>(element), claim_head());
+    }
+
+    auto pop() noexcept {
+        return static_cast<Derived&>(*this).do_pop(claim_tail());
+    }
+
+    // For non-atomic elements only. emplace constructs the element in its slot from args, avoiding the construction of a
+    // temporary element and the assignment of it into the slot. consume calls f with a reference to the element in its slot and
+    // releases the slot after f returns, so that f can process a large element without moving it out.
+
+    template<class... Args>
+    bool try_emplace(Args&&... args) noexcept {
+        Index head;
+        if(!try_claim_head(head))
+            return false;
+        static_cast<Derived&>(*this).do_emplace(head, std::forward<Args>(args)...);
+        return true;
+    }
+
+    template<class... Args>
+    void emplace(Args&&... args) noexcept {
+        static_cast<Derived&>(*this).do_emplace(claim_head(), std::forward<Args>(args)...);
+    }
+
+    template<class F>
+    bool try_consume(F&& f) noexcept {
+        Index tail;
+        if(!try_claim_tail(tail))
+            return false;
+        static_cast<Derived&>(*this).do_consume(tail, f);
+        return true;
+    }
+
+    template<class F>
+    void consume(F&& f) noexcept {
+        static_cast<Derived&>(*this).do_consume(claim_tail(), f);
+    }
+
+    // The batch versions claim a range of consecutive indices with one atomic operation on head_/tail_ and then fill or drain
+    // the slots one by one. Use std::move_iterator to move the elements in.
+
+    // Pushes as many elements of [first, last) as fit. Returns the number of elements pushed.
+    template<class ForwardIt>
+    unsigned try_push_n(ForwardIt first, ForwardIt last) noexcept {
+        using Stats = typename Derived::stats_policy;
+        unsigned const n = static_cast<unsigned>(std::distance(first, last));
+        auto head = head_.load(X);
+        unsigned count;
+        if(Derived::spsc_) {
+            if(!(count = free_slots(head, tail_.load(X), n))) {
+                Stats::full();
+                return 0;
+            }
+            head_.store(head + count, X);
+        }
+        else {
+            for(;;) { // This loop is not FIFO.
+                if(!(count = free_slots(head, tail_.load(X), n))) {
+                    Stats::full();
+                    return 0;
+                }
+                if(ATOMIC_QUEUE_LIKELY(head_.compare_exchange_weak(head, head + count, X, X)))
+                    break;
+                Stats::cas_failure();
+            }
+        }
+        ATOMIC_QUEUE_PROBE3(push_claim, this, head, count);
+
+        for(unsigned i = 0; i < count; ++i, ++first)
+            static_cast<Derived&>(*this).do_push(*first, head + i);
+        return count;
+    }
+
+    // Pops up to max elements. Returns the number of elements popped.
+    template<class OutputIt>
+    unsigned try_pop_n(OutputIt out, unsigned max) noexcept {
+        Index tail;
+        unsigned const count = try_claim_tail_n(tail, max);
+        for(unsigned i = 0; i < count; ++i, ++out)
+            *out = static_cast<Derived&>(*this).do_pop(tail + i);
+        return count;
+    }
+
+    template<class ForwardIt>
+    void push_n(ForwardIt first, ForwardIt last) noexcept {
+        unsigned const n = static_cast<unsigned>(std::distance(first, last));
+        Index head;
+        if(Derived::spsc_) {
+            head = head_.load(X);
+            head_.store(head + n, X);
+        }
+        else {
+            constexpr auto memory_order = Derived::total_order_ ? std::memory_order_seq_cst : std::memory_order_relaxed;
+            head = head_.fetch_add(n, memory_order);
+        }
+        ATOMIC_QUEUE_PROBE3(push_claim, this, head, n);
+        for(; first != last; ++first, ++head)
+            static_cast<Derived&>(*this).do_push(*first, head);
+    }
+
+    // Pops exactly n elements. Returns the output iterator past the last element popped.
+    template<class OutputIt>
+    OutputIt pop_n(OutputIt out, unsigned n) noexcept {
+        Index tail;
+        if(Derived::spsc_) {
+            tail = tail_.load(X);
+            tail_.store(tail + n, X);
+        }
+        else {
+            constexpr auto memory_order = Derived::total_order_ ? std::memory_order_seq_cst : std::memory_order_relaxed;
+            tail = tail_.fetch_add(n, memory_order);
+        }
+        ATOMIC_QUEUE_PROBE3(pop_claim, this, tail, n);
+        for(unsigned i = 0; i < n; ++i, ++out)
+            *out = static_cast<Derived&>(*this).do_pop(tail + i);
+        return out;
     }
 
     bool was_empty() const noexcept {
@@ -334,24 +888,27 @@ public:
     }
 
     bool was_full() const noexcept {
-        return was_size() >= static_cast<int>(static_cast<Derived const&>(*this).size_);
+        return was_size() >= static_cast<Derived const&>(*this).size_;
     }
 
-    unsigned was_size() const noexcept {
+    Index was_size() const noexcept {
         // tail_ can be greater than head_ because of consumers doing pop, rather that try_pop, when the queue is empty.
-        return std::max(static_cast<int>(head_.load(X) - tail_.load(X)), 0);
+        return std::max<Difference>(static_cast<Difference>(head_.load(X) - tail_.load(X)), 0);
     }
 
-    unsigned capacity() const noexcept {
+    Index capacity() const noexcept {
         return static_cast<Derived const&>(*this).size_;
     }
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template<class T, unsigned SIZE, T NIL = details::nil<T>(), bool MINIMIZE_CONTENTION = true, bool MAXIMIZE_THROUGHPUT = true, bool TOTAL_ORDER = false, bool SPSC = false>
-class AtomicQueue : public AtomicQueueCommon<AtomicQueue<T, SIZE, NIL, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>> {
-    using Base = AtomicQueueCommon<AtomicQueue<T, SIZE, NIL, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>>;
+template<class T, unsigned SIZE, T NIL = details::nil<T>(), bool MINIMIZE_CONTENTION = true, bool MAXIMIZE_THROUGHPUT = true, bool TOTAL_ORDER = false, bool SPSC = false,
+         class WAIT = SpinWait, class STATS = NoStats>
+class AtomicQueue : public AtomicQueueCommon<AtomicQueue<T, SIZE, NIL, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC, WAIT, STATS>> {
+    using Base = AtomicQueueCommon<AtomicQueue<T, SIZE, NIL, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC, WAIT, STATS>>;
+    using wait_strategy = WAIT;
+    using stats_policy = STATS;
     friend Base;
 
     static constexpr unsigned size_ = MINIMIZE_CONTENTION ? details::round_up_to_power_of_2(SIZE) : SIZE;
@@ -387,30 +944,43 @@ public:
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template<class T, unsigned SIZE, bool MINIMIZE_CONTENTION = true, bool MAXIMIZE_THROUGHPUT = true, bool TOTAL_ORDER = false, bool SPSC = false>
-class AtomicQueue2 : public AtomicQueueCommon<AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>> {
-    using Base = AtomicQueueCommon<AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>>;
-    using State = typename Base::State;
+template<class T, unsigned SIZE, bool MINIMIZE_CONTENTION = true, bool MAXIMIZE_THROUGHPUT = true, bool TOTAL_ORDER = false, bool SPSC = false,
+         SlotLayout LAYOUT = SlotLayout::SEPARATE, class WAIT = SpinWait, class STATS = NoStats>
+class AtomicQueue2 : public AtomicQueueCommon<AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC, LAYOUT, WAIT, STATS>> {
+    using Base = AtomicQueueCommon<AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC, LAYOUT, WAIT, STATS>>;
+    using wait_strategy = WAIT;
+    using stats_policy = STATS;
     friend Base;
 
     static constexpr unsigned size_ = MINIMIZE_CONTENTION ? details::round_up_to_power_of_2(SIZE) : SIZE;
-    static constexpr int SHUFFLE_BITS = details::GetIndexShuffleBits<MINIMIZE_CONTENTION, size_, CACHE_LINE_SIZE / sizeof(State)>::value;
+    static constexpr int SHUFFLE_BITS = details::GetIndexShuffleBits<MINIMIZE_CONTENTION, size_, details::SlotsPerCacheLine<T, LAYOUT>::value>::value;
     static constexpr bool total_order_ = TOTAL_ORDER;
     static constexpr bool spsc_ = SPSC;
     static constexpr bool maximize_throughput_ = MAXIMIZE_THROUGHPUT;
 
-    alignas(CACHE_LINE_SIZE) std::atomic<unsigned char> states_[size_] = {};
-    alignas(CACHE_LINE_SIZE) T elements_[size_] = {};
+    details::SlotArray<T, size_, LAYOUT> slots_;
 
     T do_pop(unsigned tail) noexcept {
         unsigned index = details::remap_index<SHUFFLE_BITS>(tail % size_);
-        return Base::do_pop_any(states_[index], elements_[index]);
+        return Base::do_pop_any(slots_.state(index), slots_.element(index));
     }
 
     template<class U>
     void do_push(U&& element, unsigned head) noexcept {
         unsigned index = details::remap_index<SHUFFLE_BITS>(head % size_);
-        Base::do_push_any(std::forward<U>(element), states_[index], elements_[index]);
+        Base::do_push_any(std::forward<U>(element), slots_.state(index), slots_.element(index));
+    }
+
+    template<class... Args>
+    void do_emplace(unsigned head, Args&&... args) noexcept {
+        unsigned index = details::remap_index<SHUFFLE_BITS>(head % size_);
+        Base::do_emplace_any(slots_.state(index), slots_.element(index), std::forward<Args>(args)...);
+    }
+
+    template<class F>
+    void do_consume(unsigned tail, F& f) noexcept {
+        unsigned index = details::remap_index<SHUFFLE_BITS>(tail % size_);
+        Base::do_consume_any(slots_.state(index), slots_.element(index), f);
     }
 
 public:
@@ -423,11 +993,15 @@ public:
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template<class T, class A = std::allocator<T>, T NIL = details::nil<T>(), bool MAXIMIZE_THROUGHPUT = true, bool TOTAL_ORDER = false, bool SPSC = false>
+// INDEX is the type of the ring-buffer indexes and the size: unsigned, or uint64_t for capacities of 2^31 elements and more.
+template<class T, class A = std::allocator<T>, T NIL = details::nil<T>(), bool MAXIMIZE_THROUGHPUT = true, bool TOTAL_ORDER = false, bool SPSC = false,
+         class WAIT = SpinWait, class INDEX = unsigned, class STATS = NoStats>
 class AtomicQueueB : private std::allocator_traits<A>::template rebind_alloc<std::atomic<T>>,
-                     public AtomicQueueCommon<AtomicQueueB<T, A, NIL, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>> {
+                     public AtomicQueueCommon<AtomicQueueB<T, A, NIL, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC, WAIT, INDEX, STATS>, INDEX> {
     using AllocatorElements = typename std::allocator_traits<A>::template rebind_alloc<std::atomic<T>>;
-    using Base = AtomicQueueCommon<AtomicQueueB<T, A, NIL, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>>;
+    using Base = AtomicQueueCommon<AtomicQueueB<T, A, NIL, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC, WAIT, INDEX, STATS>, INDEX>;
+    using wait_strategy = WAIT;
+    using stats_policy = STATS;
     friend Base;
 
     static constexpr bool total_order_ = TOTAL_ORDER;
@@ -442,16 +1016,17 @@ class AtomicQueueB : private std::allocator_traits<A>::template rebind_alloc<std
 
     // AtomicQueueCommon members are stored into by readers and writers.
     // Allocate these immutable members on another cache line which never gets invalidated by stores.
-    alignas(CACHE_LINE_SIZE) unsigned size_;
+    alignas(CACHE_LINE_SIZE) INDEX size_;
+    details::RingIndex<SHUFFLE_BITS, INDEX> index_;
     std::atomic<T>* elements_;
 
-    T do_pop(unsigned tail) noexcept {
-        std::atomic<T>& q_element = details::map<SHUFFLE_BITS>(elements_, tail & (size_ - 1));
+    T do_pop(INDEX tail) noexcept {
+        std::atomic<T>& q_element = elements_[index_(tail)];
         return Base::template do_pop_atomic<T, NIL>(q_element);
     }
 
-    void do_push(T element, unsigned head) noexcept {
-        std::atomic<T>& q_element = details::map<SHUFFLE_BITS>(elements_, head & (size_ - 1));
+    void do_push(T element, INDEX head) noexcept {
+        std::atomic<T>& q_element = elements_[index_(head)];
         Base::template do_push_atomic<T, NIL>(element, q_element);
     }
 
@@ -461,19 +1036,18 @@ public:
 
     // The special member functions are not thread-safe.
 
-    AtomicQueueB(unsigned size, A const& allocator = A{})
-        : AllocatorElements(allocator)
-        , size_(std::max(details::round_up_to_power_of_2(size), 1u << (SHUFFLE_BITS * 2)))
-        , elements_(AllocatorElements::allocate(size_)) {
-        assert(std::atomic<T>{NIL}.is_lock_free()); // Queue element type T is not atomic. Use AtomicQueue2/AtomicQueueB2 for such element types.
-        std::uninitialized_fill_n(elements_, size_, NIL);
-        assert(get_allocator() == allocator); // The standard requires the original and rebound allocators to manage the same state.
-    }
+    AtomicQueueB(INDEX size, A const& allocator = A{})
+        : AtomicQueueB(std::max<INDEX>(details::round_up_to_power_of_2(size), 1u << (SHUFFLE_BITS * 2)), allocator, 0) {}
+
+    // The capacity is exactly size, only a size of 0 becomes 1.
+    AtomicQueueB(ArbitraryCapacity, INDEX size, A const& allocator = A{})
+        : AtomicQueueB(std::max<INDEX>(size, 1), allocator, 0) {}
 
     AtomicQueueB(AtomicQueueB&& b) noexcept
         : AllocatorElements(static_cast<AllocatorElements&&>(b)) // TODO: This must be noexcept, static_assert that.
         , Base(static_cast<Base&&>(b))
         , size_(std::exchange(b.size_, 0))
+        , index_(std::exchange(b.index_, details::RingIndex<SHUFFLE_BITS, INDEX>{}))
         , elements_(std::exchange(b.elements_, nullptr))
     {}
 
@@ -498,23 +1072,38 @@ public:
         swap(static_cast<AllocatorElements&>(*this), static_cast<AllocatorElements&>(b));
         Base::swap(b);
         swap(size_, b.size_);
+        swap(index_, b.index_);
         swap(elements_, b.elements_);
     }
 
     friend void swap(AtomicQueueB& a, AtomicQueueB& b) noexcept {
         a.swap(b);
     }
+
+private:
+    AtomicQueueB(INDEX size, A const& allocator, int)
+        : AllocatorElements(allocator)
+        , size_(size)
+        , index_(size)
+        , elements_(AllocatorElements::allocate(size_)) {
+        assert(std::atomic<T>{NIL}.is_lock_free()); // Queue element type T is not atomic. Use AtomicQueue2/AtomicQueueB2 for such element types.
+        std::uninitialized_fill_n(elements_, size_, NIL);
+        assert(get_allocator() == allocator); // The standard requires the original and rebound allocators to manage the same state.
+    }
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template<class T, class A = std::allocator<T>, bool MAXIMIZE_THROUGHPUT = true, bool TOTAL_ORDER = false, bool SPSC = false>
+// INDEX is as in AtomicQueueB.
+template<class T, class A = std::allocator<T>, bool MAXIMIZE_THROUGHPUT = true, bool TOTAL_ORDER = false, bool SPSC = false,
+         SlotLayout LAYOUT = SlotLayout::SEPARATE, class WAIT = SpinWait, class INDEX = unsigned, class STATS = NoStats>
 class AtomicQueueB2 : private std::allocator_traits<A>::template rebind_alloc<unsigned char>,
-                      public AtomicQueueCommon<AtomicQueueB2<T, A, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>> {
+                      public AtomicQueueCommon<AtomicQueueB2<T, A, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC, LAYOUT, WAIT, INDEX, STATS>, INDEX> {
     using StorageAllocator = typename std::allocator_traits<A>::template rebind_alloc<unsigned char>;
-    using Base = AtomicQueueCommon<AtomicQueueB2<T, A, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>>;
-    using State = typename Base::State;
-    using AtomicState = std::atomic<unsigned char>;
+    using Base = AtomicQueueCommon<AtomicQueueB2<T, A, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC, LAYOUT, WAIT, INDEX, STATS>, INDEX>;
+    using Slots = details::SlotStorage<T, LAYOUT>;
+    using wait_strategy = WAIT;
+    using stats_policy = STATS;
     friend Base;
 
     static constexpr bool total_order_ = TOTAL_ORDER;
@@ -523,37 +1112,33 @@ class AtomicQueueB2 : private std::allocator_traits<A>::template rebind_alloc<un
 
     // AtomicQueueCommon members are stored into by readers and writers.
     // Allocate these immutable members on another cache line which never gets invalidated by stores.
-    alignas(CACHE_LINE_SIZE) unsigned size_;
-    AtomicState* states_;
-    T* elements_;
-
-    static constexpr auto STATES_PER_CACHE_LINE = CACHE_LINE_SIZE / sizeof(AtomicState);
-    static_assert(STATES_PER_CACHE_LINE, "Unexpected STATES_PER_CACHE_LINE.");
+    alignas(CACHE_LINE_SIZE) INDEX size_;
+    static constexpr auto SHUFFLE_BITS = details::GetCacheLineIndexBits<details::SlotsPerCacheLine<T, LAYOUT>::value>::value;
 
-    static constexpr auto SHUFFLE_BITS = details::GetCacheLineIndexBits<STATES_PER_CACHE_LINE>::value;
-    static_assert(SHUFFLE_BITS, "Unexpected SHUFFLE_BITS.");
+    details::RingIndex<SHUFFLE_BITS, INDEX> index_;
+    Slots slots_;
 
-    T do_pop(unsigned tail) noexcept {
-        unsigned index = details::remap_index<SHUFFLE_BITS>(tail & (size_ - 1));
-        return Base::do_pop_any(states_[index], elements_[index]);
+    T do_pop(INDEX tail) noexcept {
+        INDEX index = index_(tail);
+        return Base::do_pop_any(slots_.state(index), slots_.element(index));
     }
 
     template<class U>
-    void do_push(U&& element, unsigned head) noexcept {
-        unsigned index = details::remap_index<SHUFFLE_BITS>(head & (size_ - 1));
-        Base::do_push_any(std::forward<U>(element), states_[index], elements_[index]);
+    void do_push(U&& element, INDEX head) noexcept {
+        INDEX index = index_(head);
+        Base::do_push_any(std::forward<U>(element), slots_.state(index), slots_.element(index));
     }
 
-    template<class U>
-    U* allocate_() {
-        U* p = reinterpret_cast<U*>(StorageAllocator::allocate(size_ * sizeof(U)));
-        assert(reinterpret_cast<uintptr_t>(p) % alignof(U) == 0); // Allocated storage must be suitably aligned for U.
-        return p;
+    template<class... Args>
+    void do_emplace(INDEX head, Args&&... args) noexcept {
+        INDEX index = index_(head);
+        Base::do_emplace_any(slots_.state(index), slots_.element(index), std::forward<Args>(args)...);
     }
 
-    template<class U>
-    void deallocate_(U* p) noexcept {
-        StorageAllocator::deallocate(reinterpret_cast<unsigned char*>(p), size_ * sizeof(U)); // TODO: This must be noexcept, static_assert that.
+    template<class F>
+    void do_consume(INDEX tail, F& f) noexcept {
+        INDEX index = index_(tail);
+        Base::do_consume_any(slots_.state(index), slots_.element(index), f);
     }
 
 public:
@@ -562,24 +1147,19 @@ public:
 
     // The special member functions are not thread-safe.
 
-    AtomicQueueB2(unsigned size, A const& allocator = A{})
-        : StorageAllocator(allocator)
-        , size_(std::max(details::round_up_to_power_of_2(size), 1u << (SHUFFLE_BITS * 2)))
-        , states_(allocate_<AtomicState>())
-        , elements_(allocate_<T>()) {
-        std::uninitialized_fill_n(states_, size_, Base::EMPTY);
-        A a = get_allocator();
-        assert(a == allocator); // The standard requires the original and rebound allocators to manage the same state.
-        for(auto p = elements_, q = elements_ + size_; p < q; ++p)
-            std::allocator_traits<A>::construct(a, p);
-    }
+    AtomicQueueB2(INDEX size, A const& allocator = A{})
+        : AtomicQueueB2(std::max<INDEX>(details::round_up_to_power_of_2(size), 1u << (SHUFFLE_BITS * 2)), allocator, 0) {}
+
+    // The capacity is exactly size, only a size of 0 becomes 1.
+    AtomicQueueB2(ArbitraryCapacity, INDEX size, A const& allocator = A{})
+        : AtomicQueueB2(std::max<INDEX>(size, 1), allocator, 0) {}
 
     AtomicQueueB2(AtomicQueueB2&& b) noexcept
         : StorageAllocator(static_cast<StorageAllocator&&>(b)) // TODO: This must be noexcept, static_assert that.
         , Base(static_cast<Base&&>(b))
         , size_(std::exchange(b.size_, 0))
-        , states_(std::exchange(b.states_, nullptr))
-        , elements_(std::exchange(b.elements_, nullptr))
+        , index_(std::exchange(b.index_, details::RingIndex<SHUFFLE_BITS, INDEX>{}))
+        , slots_(std::move(b.slots_))
     {}
 
     AtomicQueueB2& operator=(AtomicQueueB2&& b) noexcept {
@@ -588,13 +1168,9 @@ public:
     }
 
     ~AtomicQueueB2() noexcept {
-        if(elements_) {
+        if(slots_) {
             A a = get_allocator();
-            for(auto p = elements_, q = elements_ + size_; p < q; ++p)
-                std::allocator_traits<A>::destroy(a, p);
-            deallocate_(elements_);
-            details::destroy_n(states_, size_);
-            deallocate_(states_);
+            StorageAllocator::deallocate(slots_.destroy(size_, a), Slots::storage_size(size_)); // TODO: This must be noexcept, static_assert that.
         }
     }
 
@@ -607,13 +1183,325 @@ public:
         swap(static_cast<StorageAllocator&>(*this), static_cast<StorageAllocator&>(b));
         Base::swap(b);
         swap(size_, b.size_);
-        swap(states_, b.states_);
-        swap(elements_, b.elements_);
+        swap(index_, b.index_);
+        slots_.swap(b.slots_);
     }
 
     friend void swap(AtomicQueueB2& a, AtomicQueueB2& b) noexcept {
         a.swap(b);
     }
+
+private:
+    AtomicQueueB2(INDEX size, A const& allocator, int)
+        : StorageAllocator(allocator)
+        , size_(size)
+        , index_(size) {
+        A a = get_allocator();
+        assert(a == allocator); // The standard requires the original and rebound allocators to manage the same state.
+        slots_.construct(StorageAllocator::allocate(Slots::storage_size(size_)), size_, a);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Producer and consumer tokens amortize the atomic operation on head_ or tail_ over BLOCK elements, so that most push and pop
+// calls through a token do not touch the contended index cache line. A token is used by one thread at a time.
+//
+// The indices are only ever claimed for the elements which exist. A producer claiming indices ahead of its elements would make
+// the consumers of those indices wait until it pushes, or forever, if it is destroyed first.
+
+// Buffers up to BLOCK elements and pushes them with one push_n. The elements become visible to the consumers only once the
+// block is full, or on flush, which the destructor calls.
+template<class Queue, unsigned BLOCK = 16>
+class ProducerToken {
+    using T = typename Queue::value_type;
+
+    Queue& q_;
+    unsigned size_ = 0;
+    T elements_[BLOCK];
+
+public:
+    explicit ProducerToken(Queue& q) noexcept
+        : q_(q) {}
+
+    ProducerToken(ProducerToken const&) = delete;
+    ProducerToken& operator=(ProducerToken const&) = delete;
+
+    ~ProducerToken() noexcept {
+        flush();
+    }
+
+    template<class U>
+    void push(U&& element) noexcept {
+        elements_[size_] = std::forward<U>(element);
+        if(++size_ == BLOCK)
+            flush();
+    }
+
+    void flush() noexcept {
+        if(size_) {
+            q_.push_n(std::make_move_iterator(elements_), std::make_move_iterator(elements_ + size_));
+            size_ = 0;
+        }
+    }
+
+    unsigned was_size() const noexcept {
+        return size_;
+    }
+};
+
+// Claims up to BLOCK indices of the elements already pushed with one atomic operation and pops them one by one. The elements
+// of the claimed indices, which the token has not popped by its destruction, are popped and pushed back into the queue with
+// one push_n. That changes their order, and makes the consuming thread a producer, which SPSC queues do not allow. The push
+// waits for free slots like push does, when the queue is full another consumer has to pop for it to complete.
+template<class Queue, unsigned BLOCK = 16>
+class ConsumerToken {
+    using T = typename Queue::value_type;
+    using Index = typename Queue::index_type;
+
+    Queue& q_;
+    Index next_ = 0;
+    unsigned count_ = 0; // Claimed indices [next_, next_ + count_).
+
+    bool claim() noexcept {
+        return (count_ = q_.try_claim_tail_n(next_, BLOCK));
+    }
+
+    T pop_claimed() noexcept {
+        --count_;
+        return q_.pop_at(next_++);
+    }
+
+public:
+    explicit ConsumerToken(Queue& q) noexcept
+        : q_(q) {}
+
+    ConsumerToken(ConsumerToken const&) = delete;
+    ConsumerToken& operator=(ConsumerToken const&) = delete;
+
+    // Pops all the claimed elements before pushing any back, because a push may claim the index of a slot still holding one of
+    // them, which no other consumer would ever pop.
+    ~ConsumerToken() noexcept {
+        T elements[BLOCK];
+        unsigned n = 0;
+        while(count_)
+            elements[n++] = pop_claimed();
+        if(n)
+            q_.push_n(std::make_move_iterator(elements), std::make_move_iterator(elements + n));
+    }
+
+    bool try_pop(T& element) noexcept {
+        if(!count_ && !claim())
+            return false;
+        element = pop_claimed();
+        return true;
+    }
+
+    // Claims one index with the queue pop when the queue is empty.
+    T pop() noexcept {
+        if(!count_ && !claim())
+            return q_.pop();
+        return pop_claimed();
+    }
+
+    unsigned was_size() const noexcept {
+        return count_;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A fixed size ring-buffer for non-atomic elements with a sequence number per slot, after Dmitry Vyukov's bounded MPMC queue.
+//
+// In AtomicQueue2 try_push and try_pop claim an index after only checking head_ - tail_, and then may have to wait in
+// do_push_any/do_pop_any for a preempted thread to finish with the slot of the previous lap. Here the slot sequence number
+// tells whether the slot is ready for the index being claimed, so that try_push and try_pop never wait for another thread.
+// The sequence number also includes the lap, which makes push and pop FIFO even when the ring-buffer wraps around.
+template<class T, unsigned SIZE, bool MINIMIZE_CONTENTION = true, bool MAXIMIZE_THROUGHPUT = true>
+class SeqAtomicQueue {
+    // The sequence numbers wrap around in unsigned arithmetic, which requires a power of 2 size.
+    static constexpr unsigned size_ = details::round_up_to_power_of_2(SIZE);
+    static constexpr int SHUFFLE_BITS = details::GetIndexShuffleBits<MINIMIZE_CONTENTION, size_, CACHE_LINE_SIZE / sizeof(std::atomic<unsigned>)>::value;
+    static constexpr bool maximize_throughput_ = MAXIMIZE_THROUGHPUT;
+
+    // Put these on different cache lines to avoid false sharing between readers and writers.
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> head_ = {};
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> tail_ = {};
+
+    // The slot for index i is ready to push when its sequence is i, and ready to pop when its sequence is i + 1.
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> sequences_[size_];
+    alignas(CACHE_LINE_SIZE) T elements_[size_] = {};
+
+    static unsigned index_of(unsigned i) noexcept {
+        return details::remap_index<SHUFFLE_BITS>(i % size_);
+    }
+
+    void wait_sequence(std::atomic<unsigned>& sequence, unsigned expected) noexcept {
+        while(ATOMIC_QUEUE_UNLIKELY(sequence.load(A) != expected))
+            if(maximize_throughput_)
+                spin_loop_pause();
+    }
+
+    // Stores the elements of the claimed indices [head, head + n) and then publishes them from the last to the first.
+    template<class ForwardIt>
+    void store_group(ForwardIt first, unsigned head, unsigned n) noexcept {
+        for(unsigned i = 0; i < n; ++i, ++first) {
+            unsigned index = index_of(head + i);
+            wait_sequence(sequences_[index], head + i);
+            elements_[index] = *first;
+        }
+        for(unsigned i = n; i--;)
+            sequences_[index_of(head + i)].store(head + i + 1, R);
+    }
+
+public:
+    using value_type = T;
+
+    SeqAtomicQueue() noexcept {
+        for(unsigned i = 0; i < size_; ++i)
+            sequences_[index_of(i)].store(i, X);
+    }
+
+    SeqAtomicQueue(SeqAtomicQueue const&) = delete;
+    SeqAtomicQueue& operator=(SeqAtomicQueue const&) = delete;
+
+    template<class U>
+    bool try_push(U&& element) noexcept {
+        for(unsigned head = head_.load(X);;) {
+            unsigned index = index_of(head);
+            int ready = static_cast<int>(sequences_[index].load(A) - head);
+            if(ATOMIC_QUEUE_LIKELY(!ready)) {
+                if(ATOMIC_QUEUE_LIKELY(head_.compare_exchange_weak(head, head + 1, X, X))) {
+                    elements_[index] = std::forward<U>(element);
+                    sequences_[index].store(head + 1, R);
+                    return true;
+                }
+            }
+            else if(ready < 0) {
+                return false; // The slot still holds the element of the previous lap.
+            }
+            else {
+                head = head_.load(X); // Another producer claimed this index.
+            }
+        }
+    }
+
+    bool try_pop(T& element) noexcept {
+        for(unsigned tail = tail_.load(X);;) {
+            unsigned index = index_of(tail);
+            int ready = static_cast<int>(sequences_[index].load(A) - (tail + 1));
+            if(ATOMIC_QUEUE_LIKELY(!ready)) {
+                if(ATOMIC_QUEUE_LIKELY(tail_.compare_exchange_weak(tail, tail + 1, X, X))) {
+                    element = std::move(elements_[index]);
+                    sequences_[index].store(tail + size_, R);
+                    return true;
+                }
+            }
+            else if(ready < 0) {
+                return false; // The element for this index has not been pushed yet.
+            }
+            else {
+                tail = tail_.load(X); // Another consumer claimed this index.
+            }
+        }
+    }
+
+    template<class U>
+    void push(U&& element) noexcept {
+        unsigned head = head_.fetch_add(1, X);
+        unsigned index = index_of(head);
+        wait_sequence(sequences_[index], head);
+        elements_[index] = std::forward<U>(element);
+        sequences_[index].store(head + 1, R);
+    }
+
+    T pop() noexcept {
+        unsigned tail = tail_.fetch_add(1, X);
+        unsigned index = index_of(tail);
+        wait_sequence(sequences_[index], tail + 1);
+        T element{std::move(elements_[index])};
+        sequences_[index].store(tail + size_, R);
+        return element;
+    }
+
+    // The group versions push the elements of [first, last) as one message: a try_pop or try_pop_n consumer observes either all
+    // the elements of the group or none of them. The consumers claim the indices in order and the first element of the group
+    // is published last, so that, once it can be claimed, the rest of the group is already published. A pop consumer claims
+    // its index before the element is published and gets no such guarantee. The group size must not exceed the capacity.
+
+    // Pushes the whole group, or nothing when the queue does not have enough free slots.
+    template<class ForwardIt>
+    bool try_push_group(ForwardIt first, ForwardIt last) noexcept {
+        unsigned const n = static_cast<unsigned>(std::distance(first, last));
+        assert(n <= size_);
+        for(unsigned head = head_.load(X);;) {
+            unsigned free = 0;
+            while(free < n && sequences_[index_of(head + free)].load(A) == head + free)
+                ++free;
+            if(ATOMIC_QUEUE_LIKELY(free == n)) {
+                if(ATOMIC_QUEUE_LIKELY(head_.compare_exchange_weak(head, head + n, X, X))) {
+                    store_group(first, head, n);
+                    return true;
+                }
+            }
+            else if(static_cast<int>(sequences_[index_of(head + free)].load(A) - (head + free)) < 0) {
+                return false; // The slot still holds the element of the previous lap.
+            }
+            else {
+                head = head_.load(X); // Another producer claimed this index.
+            }
+        }
+    }
+
+    template<class ForwardIt>
+    void push_group(ForwardIt first, ForwardIt last) noexcept {
+        unsigned const n = static_cast<unsigned>(std::distance(first, last));
+        assert(n <= size_);
+        store_group(first, head_.fetch_add(n, X), n);
+    }
+
+    // Pops up to max consecutive published elements. Returns the number of elements popped.
+    template<class OutputIt>
+    unsigned try_pop_n(OutputIt out, unsigned max) noexcept {
+        for(unsigned tail = tail_.load(X);;) {
+            unsigned count = 0;
+            while(count < max && sequences_[index_of(tail + count)].load(A) == tail + count + 1)
+                ++count;
+            if(ATOMIC_QUEUE_LIKELY(count)) {
+                if(ATOMIC_QUEUE_LIKELY(tail_.compare_exchange_weak(tail, tail + count, X, X))) {
+                    for(unsigned i = 0; i < count; ++i, ++out) {
+                        unsigned index = index_of(tail + i);
+                        *out = std::move(elements_[index]);
+                        sequences_[index].store(tail + i + size_, R);
+                    }
+                    return count;
+                }
+            }
+            else if(!max || static_cast<int>(sequences_[index_of(tail)].load(A) - (tail + 1)) < 0) {
+                return 0; // The element for this index has not been pushed yet.
+            }
+            else {
+                tail = tail_.load(X); // Another consumer claimed this index.
+            }
+        }
+    }
+
+    bool was_empty() const noexcept {
+        return !was_size();
+    }
+
+    bool was_full() const noexcept {
+        return was_size() >= size_;
+    }
+
+    unsigned was_size() const noexcept {
+        // tail_ can be greater than head_ because of consumers doing pop, rather that try_pop, when the queue is empty.
+        return std::max(static_cast<int>(head_.load(X) - tail_.load(X)), 0);
+    }
+
+    static constexpr unsigned capacity() noexcept {
+        return size_;
+    }
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
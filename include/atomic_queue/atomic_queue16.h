@@ -0,0 +1,253 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_ATOMIC_QUEUE16_H_INCLUDED
+#define ATOMIC_QUEUE_ATOMIC_QUEUE16_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#define ATOMIC_QUEUE_CAS16 1
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#define ATOMIC_QUEUE_CAS16 1
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+namespace details {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A 16-byte value as two 64-bit words, the lower address word first.
+struct alignas(16) Words16 {
+    uint64_t lo, hi;
+};
+
+inline bool operator==(Words16 a, Words16 b) noexcept {
+    return a.lo == b.lo && a.hi == b.hi;
+}
+
+inline bool operator!=(Words16 a, Words16 b) noexcept {
+    return !(a == b);
+}
+
+// A 16-byte atomic cell, updated with a double-width compare-and-swap. The words are also readable separately, which may
+// return a torn value. That is only good enough for busy-waiting until the value changes.
+struct alignas(16) Atomic16 {
+    std::atomic<uint64_t> words[2] = {};
+
+    Words16 load_torn() const noexcept {
+        return {words[0].load(X), words[1].load(X)};
+    }
+};
+
+// The fallback for CPUs without a double-width compare-and-swap: a lock per cache line from a small lock table.
+inline std::atomic<bool>& cas16_lock(Atomic16 const& a) noexcept {
+    struct alignas(CACHE_LINE_SIZE) Lock {
+        std::atomic<bool> locked;
+    };
+    static Lock locks[64];
+    return locks[(reinterpret_cast<uintptr_t>(&a) / CACHE_LINE_SIZE) % 64].locked;
+}
+
+inline bool cas16_locked(Atomic16& a, Words16& expected, Words16 desired) noexcept {
+    std::atomic<bool>& lock = cas16_lock(a);
+    while(ATOMIC_QUEUE_UNLIKELY(lock.exchange(true, A)))
+        do
+            spin_loop_pause();
+        while(lock.load(X));
+    Words16 current = a.load_torn(); // Not torn under the lock.
+    bool const success = current == expected;
+    if(success) {
+        a.words[0].store(desired.lo, X);
+        a.words[1].store(desired.hi, X);
+    }
+    else {
+        expected = current;
+    }
+    lock.store(false, R);
+    return success;
+}
+
+#if defined(__x86_64__) && defined(ATOMIC_QUEUE_CAS16)
+
+inline bool has_cas16() noexcept {
+    static bool const supported = [] {
+        unsigned eax, ebx, ecx, edx;
+        return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 13)); // CPUID.01H:ECX.CMPXCHG16B[bit 13]
+    }();
+    return supported;
+}
+
+// A full barrier, as any locked instruction.
+inline bool cas16_native(Atomic16& a, Words16& expected, Words16 desired) noexcept {
+    bool success;
+    asm volatile("lock cmpxchg16b %1"
+                 : "=@ccz"(success), "+m"(a), "+a"(expected.lo), "+d"(expected.hi)
+                 : "b"(desired.lo), "c"(desired.hi)
+                 : "memory");
+    return success;
+}
+
+#elif defined(__aarch64__) && defined(ATOMIC_QUEUE_CAS16)
+
+// The exclusive pair load/store of ARMv8.0 is always available, casp needs the ARMv8.1 LSE atomics.
+inline bool has_cas16() noexcept {
+    return true;
+}
+
+inline bool has_lse() noexcept {
+#if defined(__ARM_FEATURE_ATOMICS)
+    return true;
+#elif defined(__linux__) && defined(HWCAP_ATOMICS)
+    static bool const supported = ::getauxval(AT_HWCAP) & HWCAP_ATOMICS;
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Acquire and release, as caspal and ldaxp/stlxp.
+inline bool cas16_native(Atomic16& a, Words16& expected, Words16 desired) noexcept {
+    if(ATOMIC_QUEUE_LIKELY(has_lse())) {
+        // casp requires consecutive even/odd register pairs.
+        register uint64_t x0 asm("x0") = expected.lo;
+        register uint64_t x1 asm("x1") = expected.hi;
+        register uint64_t x2 asm("x2") = desired.lo;
+        register uint64_t x3 asm("x3") = desired.hi;
+        asm volatile(".arch_extension lse\n\tcaspal %0, %1, %3, %4, %2"
+                     : "+r"(x0), "+r"(x1), "+Q"(a)
+                     : "r"(x2), "r"(x3)
+                     : "memory");
+        bool const success = x0 == expected.lo && x1 == expected.hi;
+        expected = {x0, x1};
+        return success;
+    }
+    Words16 current;
+    unsigned failed;
+    do {
+        asm volatile("ldaxp %0, %1, %2" : "=&r"(current.lo), "=&r"(current.hi) : "Q"(a) : "memory");
+        // Store the loaded value back on a mismatch, only a successful store-exclusive makes the pair load single-copy atomic.
+        Words16 store = current == expected ? desired : current;
+        asm volatile("stlxp %w0, %2, %3, %1" : "=&r"(failed), "=Q"(a) : "r"(store.lo), "r"(store.hi) : "memory");
+    } while(ATOMIC_QUEUE_UNLIKELY(failed));
+    bool const success = current == expected;
+    expected = current;
+    return success;
+}
+
+#endif
+
+// Detects the double-width compare-and-swap at run-time and falls back to the lock table.
+inline bool cas16(Atomic16& a, Words16& expected, Words16 desired) noexcept {
+#ifdef ATOMIC_QUEUE_CAS16
+    if(ATOMIC_QUEUE_LIKELY(has_cas16()))
+        return cas16_native(a, expected, desired);
+#endif
+    return cas16_locked(a, expected, desired);
+}
+
+// Whether AtomicQueue16 is lock-free on this CPU.
+inline bool cas16_is_lock_free() noexcept {
+#ifdef ATOMIC_QUEUE_CAS16
+    return has_cas16();
+#else
+    return false;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace details
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A fixed size ring-buffer for 16-byte trivially copyable elements, such as pointer and tag or pointer and length pairs, which
+// std::atomic<T> does not support lock-free. Like AtomicQueue, there is no state array, each slot is the element itself and a
+// NIL element marks an empty slot. NIL is the element with all bits zero, which must not be pushed.
+//
+// The slots are updated with cmpxchg16b on x86-64 and casp, or ldaxp/stlxp, on AArch64. When the CPU does not have cmpxchg16b,
+// detected at run-time, or on other architectures, the slots are updated under a lock from a small lock table instead.
+template<class T, unsigned SIZE, bool MINIMIZE_CONTENTION = true, bool MAXIMIZE_THROUGHPUT = true, bool TOTAL_ORDER = false, bool SPSC = false>
+class AtomicQueue16 : public AtomicQueueCommon<AtomicQueue16<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>> {
+    using Base = AtomicQueueCommon<AtomicQueue16<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, TOTAL_ORDER, SPSC>>;
+    using stats_policy = NoStats;
+    friend Base;
+
+    static_assert(sizeof(T) == 16 && std::is_trivially_copyable<T>::value, "AtomicQueue16 requires a 16-byte trivially copyable T.");
+
+    static constexpr unsigned size_ = MINIMIZE_CONTENTION ? details::round_up_to_power_of_2(SIZE) : SIZE;
+    static constexpr int SHUFFLE_BITS = details::GetIndexShuffleBits<MINIMIZE_CONTENTION, size_, CACHE_LINE_SIZE / sizeof(details::Atomic16)>::value;
+    static constexpr bool total_order_ = TOTAL_ORDER;
+    static constexpr bool spsc_ = SPSC;
+    static constexpr bool maximize_throughput_ = MAXIMIZE_THROUGHPUT;
+
+    alignas(CACHE_LINE_SIZE) details::Atomic16 elements_[size_];
+
+    static details::Words16 to_words(T const& element) noexcept {
+        details::Words16 words;
+        std::memcpy(&words, &element, sizeof words);
+        return words;
+    }
+
+    T do_pop(unsigned tail) noexcept {
+        details::Atomic16& q_element = details::map<SHUFFLE_BITS>(elements_, tail % size_);
+        constexpr details::Words16 nil = {0, 0};
+        for(details::Words16 words = q_element.load_torn();;) {
+            if(ATOMIC_QUEUE_LIKELY(words != nil)) {
+                if(ATOMIC_QUEUE_LIKELY(details::cas16(q_element, words, nil))) { // A failed cas16 loads the current value.
+                    T element;
+                    std::memcpy(&element, &words, sizeof element);
+                    return element;
+                }
+                continue;
+            }
+            // Do speculative loads while busy-waiting to avoid broadcasting RFO messages.
+            do
+                spin_loop_pause();
+            while(maximize_throughput_ && q_element.load_torn() == nil);
+            words = q_element.load_torn();
+        }
+    }
+
+    void do_push(T element, unsigned head) noexcept {
+        details::Atomic16& q_element = details::map<SHUFFLE_BITS>(elements_, head % size_);
+        constexpr details::Words16 nil = {0, 0};
+        details::Words16 const words = to_words(element);
+        assert(words != nil);
+        for(details::Words16 expected = nil; ATOMIC_QUEUE_UNLIKELY(!details::cas16(q_element, expected, words)); expected = nil) {
+            do
+                spin_loop_pause();
+            while(maximize_throughput_ && q_element.load_torn() != nil);
+        }
+    }
+
+public:
+    using value_type = T;
+
+    AtomicQueue16() noexcept = default;
+    AtomicQueue16(AtomicQueue16 const&) = delete;
+    AtomicQueue16& operator=(AtomicQueue16 const&) = delete;
+
+    // False when the slots are updated under locks.
+    static bool is_lock_free() noexcept {
+        return details::cas16_is_lock_free();
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_ATOMIC_QUEUE16_H_INCLUDED
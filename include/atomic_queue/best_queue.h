@@ -0,0 +1,137 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_BEST_QUEUE_H_INCLUDED
+#define ATOMIC_QUEUE_BEST_QUEUE_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+#include "spsc_queue.h"
+
+#include <type_traits>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+enum class QueueKind {
+    ATOMIC_QUEUE,     // AtomicQueue, for atomic elements.
+    ATOMIC_QUEUE2,    // AtomicQueue2, for any elements.
+    SPSC_ATOMIC_QUEUE // SpscAtomicQueue, for 1 producer and 1 consumer only.
+};
+
+namespace details {
+
+// Whether T can be an AtomicQueue element: a lock-free atomic type which can also be the NIL template argument.
+template<class T>
+struct IsAtomicElement : std::integral_constant<bool, (std::is_integral<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value) &&
+                                                          sizeof(T) <= sizeof(uint64_t)> {};
+
+} // namespace details
+
+// The NIL template argument of BestQueue, a value T elements must never have, which AtomicQueue requires. Any class with a
+// static constexpr T value member will do.
+template<class T, T VALUE>
+struct Nil {
+    static constexpr T value = VALUE;
+};
+
+template<class T, T VALUE>
+constexpr T Nil<T, VALUE>::value;
+
+// No NIL value, the default: the elements may have any value, which rules AtomicQueue out.
+struct NoNil {};
+
+// A queue implementation and its flags.
+template<QueueKind KIND, bool MINIMIZE_CONTENTION, bool MAXIMIZE_THROUGHPUT>
+struct QueueTuned {
+    static constexpr QueueKind kind = KIND;
+    static constexpr bool minimize_contention = MINIMIZE_CONTENTION;
+    static constexpr bool maximize_throughput = MAXIMIZE_THROUGHPUT;
+};
+
+template<QueueKind KIND, bool MINIMIZE_CONTENTION, bool MAXIMIZE_THROUGHPUT>
+constexpr QueueKind QueueTuned<KIND, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT>::kind;
+template<QueueKind KIND, bool MINIMIZE_CONTENTION, bool MAXIMIZE_THROUGHPUT>
+constexpr bool QueueTuned<KIND, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT>::minimize_contention;
+template<QueueKind KIND, bool MINIMIZE_CONTENTION, bool MAXIMIZE_THROUGHPUT>
+constexpr bool QueueTuned<KIND, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT>::maximize_throughput;
+
+// The queue implementation and flags for a {1 producer and 1 consumer or more, atomic elements with a NIL value or not}
+// combination.
+//
+// The defaults are the findings of the throughput benchmarks: for SPSC MINIMIZE_CONTENTION=false and MAXIMIZE_THROUGHPUT=false,
+// for MPMC MINIMIZE_CONTENTION=true and MAXIMIZE_THROUGHPUT=true. The autotune tool measures them on the target host and writes
+// a header with the specializations of QueueTuning for that host, e.g.:
+//
+//     template<> struct QueueTuning<true, true> : QueueTuned<QueueKind::SPSC_ATOMIC_QUEUE, false, false> {};
+//
+// Define ATOMIC_QUEUE_TUNED_HEADER to that header name, e.g. -DATOMIC_QUEUE_TUNED_HEADER='"atomic_queue_tuned.h"', for the
+// specializations to replace the defaults.
+template<bool SPSC, bool ATOMIC_ELEMENTS>
+struct QueueTuning : QueueTuned<ATOMIC_ELEMENTS ? QueueKind::ATOMIC_QUEUE : QueueKind::ATOMIC_QUEUE2, !SPSC, !SPSC> {};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+#ifdef ATOMIC_QUEUE_TUNED_HEADER
+#include ATOMIC_QUEUE_TUNED_HEADER
+#endif
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace details {
+
+template<QueueKind KIND, class T, unsigned SIZE, bool SPSC, bool MINIMIZE_CONTENTION, bool MAXIMIZE_THROUGHPUT, class NIL = NoNil>
+struct QueueOfKind;
+
+template<class T, unsigned SIZE, bool SPSC, bool MINIMIZE_CONTENTION, bool MAXIMIZE_THROUGHPUT, class NIL>
+struct QueueOfKind<QueueKind::ATOMIC_QUEUE, T, SIZE, SPSC, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, NIL> {
+    static_assert(IsAtomicElement<T>::value, "QueueKind::ATOMIC_QUEUE requires atomic elements.");
+    static_assert(!std::is_same<NIL, NoNil>::value, "QueueKind::ATOMIC_QUEUE requires a NIL value.");
+    using type = AtomicQueue<T, SIZE, NIL::value, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, false, SPSC>;
+};
+
+template<class T, unsigned SIZE, bool SPSC, bool MINIMIZE_CONTENTION, bool MAXIMIZE_THROUGHPUT, class NIL>
+struct QueueOfKind<QueueKind::ATOMIC_QUEUE2, T, SIZE, SPSC, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, NIL> {
+    using type = AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, false, SPSC>;
+};
+
+template<class T, unsigned SIZE, bool SPSC, bool MINIMIZE_CONTENTION, bool MAXIMIZE_THROUGHPUT, class NIL>
+struct QueueOfKind<QueueKind::SPSC_ATOMIC_QUEUE, T, SIZE, SPSC, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, NIL> {
+    static_assert(SPSC, "QueueKind::SPSC_ATOMIC_QUEUE requires 1 producer and 1 consumer.");
+    using type = SpscAtomicQueue<T, SIZE>;
+};
+
+} // namespace details
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Selects the queue implementation and flags for PRODUCERS and CONSUMERS threads at compile time. The queues are the push/pop
+// busy-waiting ones. AtomicQueue is a candidate only for atomic elements with an explicit NIL, e.g. Nil<int, -1>, a value the
+// elements never have, because it cannot store its NIL value. Otherwise the elements may have any value and AtomicQueue2 or
+// SpscAtomicQueue is selected.
+template<class T, unsigned CAPACITY, unsigned PRODUCERS, unsigned CONSUMERS, class NIL = NoNil>
+struct BestQueue {
+    static_assert(PRODUCERS && CONSUMERS, "At least 1 producer and 1 consumer are required.");
+
+    static constexpr bool spsc = PRODUCERS == 1 && CONSUMERS == 1;
+    static constexpr bool atomic_elements = details::IsAtomicElement<T>::value && !std::is_same<NIL, NoNil>::value;
+    using tuning = QueueTuning<spsc, atomic_elements>;
+    using type = typename details::QueueOfKind<tuning::kind, T, CAPACITY, spsc, tuning::minimize_contention, tuning::maximize_throughput, NIL>::type;
+};
+
+template<class T, unsigned CAPACITY, unsigned PRODUCERS, unsigned CONSUMERS, class NIL = NoNil>
+using best_queue_t = typename BestQueue<T, CAPACITY, PRODUCERS, CONSUMERS, NIL>::type;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_BEST_QUEUE_H_INCLUDED
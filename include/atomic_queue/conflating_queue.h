@@ -0,0 +1,148 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_CONFLATING_QUEUE_H_INCLUDED
+#define ATOMIC_QUEUE_CONFLATING_QUEUE_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+#include "spinlock.h"
+
+#include <functional>
+#include <type_traits>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A queue which keeps at most one pending element per key: pushing an element with the key of a pending element overwrites
+// the pending element in place. The elements are popped in the order their keys first became pending. Producers never block
+// on a slow consumer and the consumer only sees the latest element for each key, so that the consumer work is bounded by the
+// number of distinct keys rather than by the rate of the producers.
+//
+// The key table has room for capacity() distinct keys, which is KEYS rounded up to a power of 2. Keys are never removed from
+// the table, try_push returns false for a new key when the table is full.
+//
+// Each key has its own spinlock, so that producers of different keys do not contend with each other.
+template<class T, unsigned KEYS, class KeyOf, class Hash = std::hash<std::decay_t<decltype(std::declval<KeyOf const&>()(std::declval<T const&>()))>>>
+class ConflatingQueue {
+public:
+    using value_type = T;
+    using key_type = std::decay_t<decltype(std::declval<KeyOf const&>()(std::declval<T const&>()))>;
+
+private:
+    static_assert(KEYS, "KEYS must be positive.");
+
+    static constexpr unsigned NIL = static_cast<unsigned>(-1);
+    static constexpr unsigned size_ = details::round_up_to_power_of_2(KEYS);
+
+    enum KeyState : unsigned char { FREE, CLAIMING, READY };
+
+    struct alignas(CACHE_LINE_SIZE) Slot {
+        Spinlock lock;
+        bool pending = false;
+        T element = {};
+    };
+
+    // Key slots pending in the order of the first arrival. Each slot is in the queue at most once, so that it never fills up.
+    AtomicQueue<unsigned, size_, NIL> order_;
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned char> key_states_[size_] = {};
+    key_type keys_[size_] = {};
+    Slot slots_[size_];
+    KeyOf key_of_;
+    Hash hash_;
+
+    // Returns the slot of the key, or NIL when the key is new and the key table is full.
+    unsigned find_or_insert(key_type const& key) noexcept {
+        unsigned index = static_cast<unsigned>(hash_(key)) % size_;
+        for(unsigned probes = 0; probes < size_; ++probes, index = (index + 1) % size_) {
+            auto& state = key_states_[index];
+            unsigned char s = state.load(A);
+            if(s == FREE) {
+                if(state.compare_exchange_strong(s, CLAIMING, A, A)) {
+                    keys_[index] = key;
+                    state.store(READY, R);
+                    return index;
+                }
+            }
+            while(ATOMIC_QUEUE_UNLIKELY(s == CLAIMING)) { // Another producer is storing a key into this slot.
+                spin_loop_pause();
+                s = state.load(A);
+            }
+            if(keys_[index] == key)
+                return index;
+        }
+        return NIL;
+    }
+
+public:
+    explicit ConflatingQueue(KeyOf key_of = KeyOf{}, Hash hash = Hash{})
+        : key_of_(std::move(key_of))
+        , hash_(std::move(hash)) {}
+
+    ConflatingQueue(ConflatingQueue const&) = delete;
+    ConflatingQueue& operator=(ConflatingQueue const&) = delete;
+
+    // Never blocks on the consumer. Returns false when the key is new and the key table is full.
+    template<class U>
+    bool try_push(U&& element) noexcept {
+        unsigned index = find_or_insert(key_of_(element));
+        if(ATOMIC_QUEUE_UNLIKELY(index == NIL))
+            return false;
+        Slot& slot = slots_[index];
+        bool first;
+        {
+            Spinlock::scoped_lock lock(slot.lock);
+            slot.element = std::forward<U>(element);
+            first = !slot.pending;
+            slot.pending = true;
+        }
+        // Outside of the lock, so that a push waiting for the consumer to vacate a slot of order_ does not block the other
+        // producers of this key. The consumer cannot clear pending before it pops the index, so the index is pushed once.
+        if(first)
+            order_.push(index);
+        return true;
+    }
+
+    bool try_pop(T& element) noexcept {
+        unsigned index;
+        if(!order_.try_pop(index))
+            return false;
+        element = take(index);
+        return true;
+    }
+
+    T pop() noexcept {
+        return take(order_.pop());
+    }
+
+    // The number of pending keys.
+    unsigned was_size() const noexcept {
+        return order_.was_size();
+    }
+
+    bool was_empty() const noexcept {
+        return order_.was_empty();
+    }
+
+    static constexpr unsigned capacity() noexcept {
+        return size_;
+    }
+
+private:
+    T take(unsigned index) noexcept {
+        Slot& slot = slots_[index];
+        Spinlock::scoped_lock lock(slot.lock);
+        slot.pending = false;
+        return std::move(slot.element);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_CONFLATING_QUEUE_H_INCLUDED
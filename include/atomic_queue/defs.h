@@ -78,6 +78,25 @@ static inline void spin_loop_pause() noexcept {}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// USDT probes of provider atomic_queue, for bpftrace and perf to attach to running processes, e.g.:
+//
+//     bpftrace -e 'usdt:./app:atomic_queue:spin_wait { @[arg1] = count(); }'
+//
+// Define ATOMIC_QUEUE_USDT to compile them in, which requires <sys/sdt.h> from systemtap-sdt-dev. A probe is a nop instruction
+// and a note in the ELF file, its arguments are evaluated into registers only. Otherwise the probes compile to nothing.
+#ifdef ATOMIC_QUEUE_USDT
+#include <sys/sdt.h>
+#define ATOMIC_QUEUE_PROBE1(name, a1) DTRACE_PROBE1(atomic_queue, name, a1)
+#define ATOMIC_QUEUE_PROBE2(name, a1, a2) DTRACE_PROBE2(atomic_queue, name, a1, a2)
+#define ATOMIC_QUEUE_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(atomic_queue, name, a1, a2, a3)
+#else
+#define ATOMIC_QUEUE_PROBE1(name, a1) static_cast<void>(0)
+#define ATOMIC_QUEUE_PROBE2(name, a1, a2) static_cast<void>(0)
+#define ATOMIC_QUEUE_PROBE3(name, a1, a2, a3) static_cast<void>(0)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 namespace atomic_queue {
 
 #if defined(__GNUC__) || defined(__clang__)
@@ -0,0 +1,143 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_LOSSY_QUEUE_H_INCLUDED
+#define ATOMIC_QUEUE_LOSSY_QUEUE_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A fixed size ring-buffer in which push never waits for consumers: when the ring-buffer is full, push overwrites the oldest
+// unread element. Meant for telemetry and debug traces, where a producer must have a hard latency bound regardless of how slow
+// the consumers are.
+//
+// Each slot has a sequence number. A consumer that finds its slot overwritten by a later push skips the overwritten elements
+// and reports their number, so that the gaps in the stream can be detected and counted.
+//
+// Each slot is a seqlock: the element is copied in and out through relaxed atomic words and a consumer retries when a
+// producer overwrote the slot while it was being read. Hence T must be trivially copyable.
+template<class T, unsigned SIZE>
+class LossyAtomicQueue {
+    static_assert(std::is_trivially_copyable<T>::value, "LossyAtomicQueue requires a trivially copyable T.");
+
+    static constexpr unsigned size_ = details::round_up_to_power_of_2(SIZE);
+    static constexpr unsigned WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    struct Slot {
+        // 2 * n + 1 while push number n writes the slot, 2 * n + 2 once it has been written.
+        std::atomic<uint64_t> version = {0};
+        std::atomic<uint64_t> words[WORDS] = {};
+    };
+
+    // 64-bit sequence numbers do not wrap around.
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> head_ = {0};
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> tail_ = {0};
+    alignas(CACHE_LINE_SIZE) Slot slots_[size_];
+
+public:
+    using value_type = T;
+
+    LossyAtomicQueue() noexcept = default;
+    LossyAtomicQueue(LossyAtomicQueue const&) = delete;
+    LossyAtomicQueue& operator=(LossyAtomicQueue const&) = delete;
+
+    // Always succeeds. An element that is overwritten before a consumer reads it is lost.
+    void push(T const& element) noexcept {
+        uint64_t n = head_.fetch_add(1, X);
+        Slot& slot = slots_[n % size_];
+        uint64_t const writing = 2 * n + 1;
+        for(uint64_t version = slot.version.load(X);;) {
+            if(ATOMIC_QUEUE_UNLIKELY(version >= writing))
+                return; // A push lapped this one and overwrote the slot already, this element is lost.
+            if(ATOMIC_QUEUE_UNLIKELY(version & 1)) {
+                // A push from the previous lap is still copying its element. That only happens when the ring-buffer has been
+                // wrapped around while one element was being copied.
+                spin_loop_pause();
+                version = slot.version.load(X);
+                continue;
+            }
+            if(ATOMIC_QUEUE_LIKELY(slot.version.compare_exchange_weak(version, writing, X, X)))
+                break;
+        }
+        std::atomic_thread_fence(R); // Order the stores into the element after the version store.
+        uint64_t words[WORDS] = {};
+        std::memcpy(words, &element, sizeof(T));
+        for(unsigned i = 0; i < WORDS; ++i)
+            slot.words[i].store(words[i], X);
+        slot.version.store(writing + 1, R);
+    }
+
+    // Returns false when there is no unread element. lost is incremented by the number of elements overwritten before they
+    // could be read since the previous call.
+    bool try_pop(T& element, uint64_t& lost) noexcept {
+        for(uint64_t tail = tail_.load(X);;) {
+            Slot& slot = slots_[tail % size_];
+            uint64_t const written = 2 * tail + 2;
+            uint64_t version = slot.version.load(A);
+            if(version < written)
+                return false; // Not pushed yet, or the push has not finished copying the element.
+            if(ATOMIC_QUEUE_LIKELY(version == written)) {
+                uint64_t words[WORDS];
+                for(unsigned i = 0; i < WORDS; ++i)
+                    words[i] = slot.words[i].load(X);
+                std::atomic_thread_fence(A); // Order the loads from the element before the version reload.
+                if(ATOMIC_QUEUE_UNLIKELY(slot.version.load(X) != version)) {
+                    tail = tail_.load(X); // Overwritten while being read.
+                    continue;
+                }
+                if(!tail_.compare_exchange_strong(tail, tail + 1, X, X))
+                    continue; // Another consumer read this element.
+                std::memcpy(&element, words, sizeof(T));
+                return true;
+            }
+            // The slot has been overwritten by a later lap. Skip to the oldest element that may still be in the ring-buffer.
+            uint64_t head = head_.load(X);
+            uint64_t oldest = head > tail + size_ ? head - size_ : tail + 1;
+            if(tail_.compare_exchange_strong(tail, oldest, X, X)) {
+                lost += oldest - tail;
+                tail = oldest;
+            }
+        }
+    }
+
+    bool try_pop(T& element) noexcept {
+        uint64_t lost = 0;
+        return try_pop(element, lost);
+    }
+
+    // The total number of elements pushed.
+    uint64_t pushed() const noexcept {
+        return head_.load(X);
+    }
+
+    unsigned was_size() const noexcept {
+        uint64_t head = head_.load(X);
+        uint64_t tail = tail_.load(X);
+        return head > tail ? static_cast<unsigned>(std::min<uint64_t>(head - tail, size_)) : 0;
+    }
+
+    bool was_empty() const noexcept {
+        return !was_size();
+    }
+
+    static constexpr unsigned capacity() noexcept {
+        return size_;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_LOSSY_QUEUE_H_INCLUDED
@@ -0,0 +1,200 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_MERGE_CONSUMER_H_INCLUDED
+#define ATOMIC_QUEUE_MERGE_CONSUMER_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+
+#include <functional>
+#include <limits>
+#include <type_traits>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Merges INPUTS queues into one stream ordered by the key KeyOf extracts from an element, with ties broken by the input
+// index, so that the output order is deterministic regardless of the timing of the producers.
+//
+// Each input queue must have one producer which pushes elements in non-decreasing key order, e.g. AtomicQueue2 or
+// AtomicQueueB2 with SPSC=true. The merging consumer is the only consumer of all the input queues.
+//
+// An element can only be emitted once every input either has an element or promises that its future elements have keys not
+// less than the element's key. An idle producer makes that promise by calling heartbeat() with its current key, otherwise
+// the merge stalls until the idle producer pushes again. A producer that is done calls close().
+//
+// The inputs are tracked by a tournament tree of the cached head keys, so that emitting an element costs O(log(INPUTS))
+// comparisons. The inputs are refilled in batches of up to BATCH elements, which keeps the consumer off the input queue
+// cache lines between refills.
+template<class Queue, unsigned INPUTS, class KeyOf, class Compare = std::less<>, unsigned BATCH = 32>
+class MergeConsumer {
+public:
+    using value_type = typename Queue::value_type;
+    using key_type = std::decay_t<decltype(std::declval<KeyOf const&>()(std::declval<value_type const&>()))>;
+
+private:
+    static_assert(INPUTS, "INPUTS must be positive.");
+    static_assert(BATCH, "BATCH must be positive.");
+    static_assert(std::is_trivially_copyable<key_type>::value, "The heartbeat keys are exchanged through std::atomic<key_type>.");
+
+    static constexpr unsigned LEAVES = details::round_up_to_power_of_2(INPUTS);
+
+    // Written by the producer of the input, read by the merging consumer.
+    struct alignas(CACHE_LINE_SIZE) Watermark {
+        std::atomic<key_type> key = {std::numeric_limits<key_type>::lowest()};
+        std::atomic<bool> closed = {false};
+    };
+
+    // Owned by the merging consumer.
+    struct Input {
+        Queue* queue;
+        key_type key;       // The key of the head element, or the lower bound of the future keys when empty.
+        unsigned head = 0;
+        unsigned size = 0;
+        bool exhausted = false;
+        value_type elements[BATCH];
+    };
+
+    Watermark watermarks_[INPUTS];
+    Input inputs_[LEAVES];
+    unsigned tree_[LEAVES * 2]; // tree_[1] is the winner, tree_[LEAVES + i] is input i.
+    KeyOf key_of_;
+    Compare compare_;
+
+    unsigned winner(unsigned a, unsigned b) const noexcept {
+        Input const& x = inputs_[a];
+        Input const& y = inputs_[b];
+        if(x.exhausted)
+            return b;
+        if(y.exhausted)
+            return a;
+        if(compare_(y.key, x.key))
+            return b;
+        if(compare_(x.key, y.key))
+            return a;
+        return a < b ? a : b;
+    }
+
+    void replay(unsigned input) noexcept {
+        for(unsigned node = (LEAVES + input) / 2; node; node /= 2)
+            tree_[node] = winner(tree_[node * 2], tree_[node * 2 + 1]);
+    }
+
+    // Returns false if the input has not changed.
+    bool refill(unsigned i) noexcept {
+        Input& input = inputs_[i];
+        Watermark& watermark = watermarks_[i];
+        // Load the watermark before popping, so that the elements pushed before the watermark was published are popped.
+        bool closed = watermark.closed.load(std::memory_order_acquire);
+        key_type key = watermark.key.load(std::memory_order_acquire);
+        unsigned n = 0;
+        while(n < BATCH && input.queue->try_pop(input.elements[n]))
+            ++n;
+        if(n) {
+            input.head = 0;
+            input.size = n;
+            input.key = key_of_(input.elements[0]);
+        }
+        else if(closed) {
+            input.exhausted = true;
+        }
+        else if(compare_(input.key, key)) {
+            input.key = key;
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+public:
+    template<class... Queues>
+    explicit MergeConsumer(KeyOf key_of, Compare compare, Queue& queue, Queues&... queues)
+        : key_of_(std::move(key_of))
+        , compare_(std::move(compare)) {
+        static_assert(1 + sizeof...(Queues) == INPUTS, "Pass INPUTS queues.");
+        Queue* q[INPUTS] = {&queue, &queues...};
+        for(unsigned i = 0; i < LEAVES; ++i) {
+            inputs_[i].queue = i < INPUTS ? q[i] : nullptr;
+            inputs_[i].key = std::numeric_limits<key_type>::lowest();
+            inputs_[i].exhausted = i >= INPUTS;
+            tree_[LEAVES + i] = i;
+        }
+        for(unsigned node = LEAVES; --node;)
+            tree_[node] = winner(tree_[node * 2], tree_[node * 2 + 1]);
+    }
+
+    template<class... Queues>
+    explicit MergeConsumer(Queue& queue, Queues&... queues)
+        : MergeConsumer(KeyOf{}, Compare{}, queue, queues...) {}
+
+    MergeConsumer(MergeConsumer const&) = delete;
+    MergeConsumer& operator=(MergeConsumer const&) = delete;
+
+    // The producer side. Input i must only be used by its producer.
+
+    // Promises that the future elements of input i have keys not less than key.
+    void heartbeat(unsigned i, key_type key) noexcept {
+        watermarks_[i].key.store(key, std::memory_order_release);
+    }
+
+    // Promises that no more elements are pushed into input i.
+    void close(unsigned i) noexcept {
+        watermarks_[i].closed.store(true, std::memory_order_release);
+    }
+
+    // The merging consumer side.
+
+    // Returns false when the next element in the merged order is not known yet, or when all the inputs are closed and drained.
+    bool try_pop(value_type& element) noexcept {
+        for(;;) {
+            unsigned i = tree_[1];
+            Input& input = inputs_[i];
+            if(ATOMIC_QUEUE_UNLIKELY(input.exhausted))
+                return false;
+            if(input.size) {
+                element = std::move(input.elements[input.head]);
+                if(--input.size)
+                    input.key = key_of_(input.elements[++input.head]);
+                else
+                    input.key = key_of_(element); // The producer keys do not decrease.
+                replay(i);
+                return true;
+            }
+            // The winner is an empty input with the least key bound. Nothing can be emitted before it is refilled or its
+            // producer promises a greater key.
+            if(!refill(i))
+                return false;
+            replay(i);
+        }
+    }
+
+    // Busy-waits for the next element. Returns false when all the inputs are closed and drained.
+    bool pop(value_type& element) noexcept {
+        while(!try_pop(element)) {
+            if(done())
+                return false;
+            spin_loop_pause();
+        }
+        return true;
+    }
+
+    bool done() const noexcept {
+        return inputs_[tree_[1]].exhausted;
+    }
+
+    static constexpr unsigned inputs() noexcept {
+        return INPUTS;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_MERGE_CONSUMER_H_INCLUDED
@@ -0,0 +1,181 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_PARTITIONED_QUEUE_H_INCLUDED
+#define ATOMIC_QUEUE_PARTITIONED_QUEUE_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace details {
+
+template<class KeyOf, class T>
+using KeyType = std::decay_t<decltype(std::declval<KeyOf const&>()(std::declval<T const&>()))>;
+
+// Iterates over an array of iterators and dereferences the iterators, for push_n of the elements of one partition.
+template<class It>
+struct IndirectIterator {
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = typename std::iterator_traits<It>::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = typename std::iterator_traits<It>::pointer;
+    using reference = typename std::iterator_traits<It>::reference;
+
+    It const* it;
+
+    reference operator*() const noexcept {
+        return **it;
+    }
+
+    IndirectIterator& operator++() noexcept {
+        ++it;
+        return *this;
+    }
+
+    IndirectIterator operator++(int) noexcept {
+        return {it++};
+    }
+
+    friend bool operator==(IndirectIterator a, IndirectIterator b) noexcept {
+        return a.it == b.it;
+    }
+
+    friend bool operator!=(IndirectIterator a, IndirectIterator b) noexcept {
+        return a.it != b.it;
+    }
+};
+
+} // namespace details
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Routes elements into one of PARTITIONS sub-queues by the hash of the key KeyOf extracts from an element. Each partition is
+// meant to be owned by one consumer, so that elements with the same key pushed by one producer are popped in the order
+// they were pushed, while the consumers scale independently of each other.
+//
+// Queue is the partition queue type, one with push_n for the range push. With one producer use SPSC=true partitions, e.g. AtomicQueue2<T, N, false, false, false, true>.
+// With multiple producers the partitions are multiple-producer-single-consumer queues. Note that AtomicQueue2 in that mode can
+// reorder the elements of one producer when another producer is preempted between claiming a slot and storing into it while
+// the ring-buffer wraps around.
+template<class Queue, unsigned PARTITIONS, class KeyOf, class Hash = std::hash<details::KeyType<KeyOf, typename Queue::value_type>>>
+class PartitionedQueue {
+    static_assert(PARTITIONS, "PARTITIONS must be positive.");
+
+    Queue partitions_[PARTITIONS];
+    KeyOf key_of_;
+    Hash hash_;
+
+    // Elements routed in one go by the range push.
+    static constexpr unsigned BATCH = 64;
+
+public:
+    using value_type = typename Queue::value_type;
+    using queue_type = Queue;
+
+    explicit PartitionedQueue(KeyOf key_of = KeyOf{}, Hash hash = Hash{})
+        : key_of_(std::move(key_of))
+        , hash_(std::move(hash)) {}
+
+    PartitionedQueue(PartitionedQueue const&) = delete;
+    PartitionedQueue& operator=(PartitionedQueue const&) = delete;
+
+    unsigned partition_of(value_type const& element) const noexcept {
+        // std::hash of integers is the identity. Fibonacci hashing mixes the bits, the multiply-shift reduces the mixed hash
+        // to [0, PARTITIONS) without a division.
+        uint64_t h = static_cast<uint64_t>(hash_(key_of_(element)));
+        uint64_t mixed = (h * 0x9e3779b97f4a7c15u) >> 32;
+        return static_cast<unsigned>((mixed * PARTITIONS) >> 32);
+    }
+
+    template<class T>
+    bool try_push(T&& element) noexcept {
+        return partitions_[partition_of(element)].try_push(std::forward<T>(element));
+    }
+
+    template<class T>
+    void push(T&& element) noexcept {
+        partitions_[partition_of(element)].push(std::forward<T>(element));
+    }
+
+    // Pushes [first, last) grouped by partition, the elements of each partition with one push_n, so that each partition head_
+    // cache line is acquired once per group rather than once per element. The order of elements within each partition is
+    // preserved. Use std::move_iterator to move the elements.
+    template<class ForwardIt>
+    void push(ForwardIt first, ForwardIt last) noexcept {
+        using Indirect = details::IndirectIterator<ForwardIt>;
+        ForwardIt elements[BATCH];
+        ForwardIt sorted[BATCH];
+        unsigned partition[BATCH];
+        while(first != last) {
+            unsigned counts[PARTITIONS + 1] = {};
+            unsigned n = 0;
+            for(; n < BATCH && first != last; ++n, ++first) {
+                elements[n] = first;
+                ++counts[(partition[n] = partition_of(*first)) + 1];
+            }
+            // A stable counting sort by partition. Partition p elements end up in [counts[p - 1], counts[p]) of sorted.
+            for(unsigned p = 1; p <= PARTITIONS; ++p)
+                counts[p] += counts[p - 1];
+            for(unsigned i = 0; i < n; ++i)
+                sorted[counts[partition[i]]++] = elements[i];
+            for(unsigned p = 0, begin = 0; p < PARTITIONS; begin = counts[p++])
+                if(counts[p] != begin)
+                    partitions_[p].push_n(Indirect{sorted + begin}, Indirect{sorted + counts[p]});
+        }
+    }
+
+    // The consumer side. Each partition must only be popped by its owner consumer to preserve the per-key order.
+
+    bool try_pop(unsigned partition, value_type& element) noexcept {
+        return partitions_[partition].try_pop(element);
+    }
+
+    auto pop(unsigned partition) noexcept {
+        return partitions_[partition].pop();
+    }
+
+    Queue& operator[](unsigned partition) noexcept {
+        return partitions_[partition];
+    }
+
+    Queue const& operator[](unsigned partition) const noexcept {
+        return partitions_[partition];
+    }
+
+    unsigned was_size() const noexcept {
+        unsigned size = 0;
+        for(auto& q : partitions_)
+            size += q.was_size();
+        return size;
+    }
+
+    bool was_empty() const noexcept {
+        return !was_size();
+    }
+
+    unsigned capacity() const noexcept {
+        return partitions_[0].capacity() * PARTITIONS;
+    }
+
+    static constexpr unsigned partitions() noexcept {
+        return PARTITIONS;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_PARTITIONED_QUEUE_H_INCLUDED
@@ -0,0 +1,351 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_PIPELINE_H_INCLUDED
+#define ATOMIC_QUEUE_PIPELINE_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Runs stages connected by queues, e.g. source -> queue -> stage -> queue -> sink, each stage in one or more threads:
+//
+//     Pipeline pipeline([&](unsigned thread) { set_thread_affinity(hw_thread_ids[thread]); });
+//     using Q = AtomicQueue2<unsigned, 1024>;
+//     auto numbers = pipeline.source<Q>("numbers", 1, [](Pipeline::Output<Q>& out) { for(unsigned n = 1; n <= N; ++n) out.push(n); });
+//     auto squares = pipeline.stage<Q>("squares", 2, numbers, [](unsigned n, Pipeline::Output<Q>& out) { out.push(n * n); });
+//     pipeline.sink("sum", 2, squares, [&](unsigned n) { sum += n; });
+//     pipeline.run(); // Returns once all stages are done.
+//
+// A source function pushes its elements into its output and returns when there are no more. A stage function is called with
+// every element popped from its input queue and pushes any number of elements into its output, a sink function consumes them.
+// A stage ends when all the threads of the stage before have ended and it has popped all the elements they pushed, so that no
+// sentinel elements are needed to end the pipeline.
+//
+// The threads pop up to BATCH elements at a time with try_pop_n and push their outputs BATCH elements at a time with push_n,
+// after each popped batch and when the function returns. A source with a long pause between elements should call
+// Output::flush. The queue before a stage of several threads must support several consumers, the queue after it several
+// producers.
+//
+// on_start(thread) runs first in each thread, the threads are numbered from 0 in the order of the stage declarations, e.g. to
+// pin them to CPUs. stats() reports the throughput of each stage and the average occupancy of its input queue.
+class Pipeline {
+public:
+    static constexpr unsigned BATCH = 64;
+
+    struct StageStats {
+        std::string name;
+        unsigned threads;
+        uint64_t elements; // Popped from the input queue, or pushed by a source.
+        double seconds;    // From run until the last thread of the stage has ended.
+        double occupancy;  // The average number of elements in the input queue sampled before every pop, divided by its capacity.
+
+        double throughput() const noexcept { // Elements per second.
+            return seconds > 0 ? elements / seconds : 0;
+        }
+    };
+
+    // The elements pushed by one thread, BATCH at a time.
+    template<class Queue>
+    class Output {
+        using T = typename Queue::value_type;
+
+        Queue& q_;
+        unsigned size_ = 0;
+        uint64_t pushed_ = 0;
+        T elements_[BATCH];
+
+    public:
+        explicit Output(Queue& q) noexcept
+            : q_(q) {}
+
+        Output(Output const&) = delete;
+        Output& operator=(Output const&) = delete;
+
+        template<class U>
+        void push(U&& element) noexcept {
+            elements_[size_] = std::forward<U>(element);
+            if(++size_ == BATCH)
+                flush();
+        }
+
+        void flush() noexcept {
+            if(size_) {
+                q_.push_n(std::make_move_iterator(elements_), std::make_move_iterator(elements_ + size_));
+                pushed_ += size_;
+                size_ = 0;
+            }
+        }
+
+        uint64_t pushed() const noexcept {
+            return pushed_;
+        }
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Stages and links are allocated with operator new and aligned here, because C++14 new does not support over-aligned types.
+    struct Node {
+        unsigned char* storage = nullptr;
+        virtual ~Node() noexcept = default;
+    };
+
+    struct NodeDelete {
+        void operator()(Node* node) const noexcept {
+            unsigned char* storage = node->storage;
+            node->~Node();
+            ::operator delete(storage);
+        }
+    };
+
+public:
+    // The queue between two stages.
+    template<class Queue>
+    class Link : Node {
+        friend class Pipeline;
+
+        Queue queue_;
+        std::atomic<unsigned> producers_ = {0}; // The running threads of the stage which pushes into the queue.
+
+    public:
+        template<class... Args>
+        explicit Link(Args&&... args)
+            : queue_(std::forward<Args>(args)...) {}
+    };
+
+private:
+    struct Stage : Node {
+        std::string name;
+        unsigned threads;
+        std::atomic<uint64_t> elements = {0};
+        std::atomic<uint64_t> occupancy = {0}; // The sum of the input queue sizes sampled.
+        std::atomic<uint64_t> polls = {0};     // The number of the input queue size samples.
+        std::atomic<Clock::rep> end = {0};     // The time the last thread of the stage has ended.
+        double capacity = 0;
+
+        Stage(std::string n, unsigned t)
+            : name(std::move(n))
+            , threads(std::max(t, 1u)) {}
+
+        virtual void work() noexcept = 0;
+
+        void ended(uint64_t e, uint64_t o, uint64_t p) noexcept {
+            elements.fetch_add(e, X);
+            occupancy.fetch_add(o, X);
+            polls.fetch_add(p, X);
+            Clock::rep const now = Clock::now().time_since_epoch().count();
+            for(Clock::rep t = end.load(X); t < now && !end.compare_exchange_weak(t, now, X, X);)
+                ;
+        }
+    };
+
+    static constexpr unsigned SPIN_COUNT = 1024;
+
+    static void idle(unsigned& count) noexcept {
+        if(++count < SPIN_COUNT)
+            spin_loop_pause();
+        else
+            std::this_thread::yield();
+    }
+
+    // Pops the elements of the input link in batches and calls consume(element) for each, followed by flush(), until the
+    // stage before has ended and the queue is empty.
+    template<class Queue, class Consume, class Flush>
+    static void drain(Stage& stage, Link<Queue>& in, Consume&& consume, Flush&& flush) noexcept {
+        typename Queue::value_type elements[BATCH];
+        uint64_t popped = 0, occupancy = 0, polls = 0;
+        for(unsigned idle_count = 0;;) {
+            bool const ended = !in.producers_.load(A); // Before try_pop_n, so that all the elements of the ended stage are seen.
+            occupancy += in.queue_.was_size();
+            ++polls;
+            if(unsigned n = in.queue_.try_pop_n(elements, BATCH)) {
+                for(unsigned i = 0; i < n; ++i)
+                    consume(std::move(elements[i]));
+                flush();
+                popped += n;
+                idle_count = 0;
+            }
+            else if(ended) {
+                break;
+            }
+            else {
+                idle(idle_count);
+            }
+        }
+        stage.ended(popped, occupancy, polls);
+    }
+
+    template<class Queue, class F>
+    struct Source : Stage {
+        Link<Queue>& out;
+        F f;
+
+        Source(std::string n, unsigned t, Link<Queue>& o, F&& fn)
+            : Stage(std::move(n), t)
+            , out(o)
+            , f(std::move(fn)) {}
+
+        void work() noexcept override {
+            Output<Queue> output(out.queue_);
+            f(output);
+            output.flush();
+            this->ended(output.pushed(), 0, 0);
+            out.producers_.fetch_sub(1, R);
+        }
+    };
+
+    template<class InQueue, class OutQueue, class F>
+    struct Transform : Stage {
+        Link<InQueue>& in;
+        Link<OutQueue>& out;
+        F f;
+
+        Transform(std::string n, unsigned t, Link<InQueue>& i, Link<OutQueue>& o, F&& fn)
+            : Stage(std::move(n), t)
+            , in(i)
+            , out(o)
+            , f(std::move(fn)) {}
+
+        void work() noexcept override {
+            Output<OutQueue> output(out.queue_);
+            drain(*this, in, [this, &output](typename InQueue::value_type&& element) { f(std::move(element), output); },
+                  [&output]() { output.flush(); });
+            out.producers_.fetch_sub(1, R);
+        }
+    };
+
+    template<class Queue, class F>
+    struct Sink : Stage {
+        Link<Queue>& in;
+        F f;
+
+        Sink(std::string n, unsigned t, Link<Queue>& i, F&& fn)
+            : Stage(std::move(n), t)
+            , in(i)
+            , f(std::move(fn)) {}
+
+        void work() noexcept override {
+            drain(*this, in, [this](typename Queue::value_type&& element) { f(std::move(element)); }, []() {});
+        }
+    };
+
+    std::function<void(unsigned)> on_start_;
+    std::vector<std::unique_ptr<Node, NodeDelete>> nodes_;
+    std::vector<Stage*> stages_;
+    Clock::time_point start_;
+
+    template<class T, class... Args>
+    T* create(Args&&... args) {
+        auto storage = static_cast<unsigned char*>(::operator new(sizeof(T) + alignof(T) - 1));
+        T* node;
+        try {
+            node = new(details::align_up(storage, alignof(T))) T(std::forward<Args>(args)...);
+        }
+        catch(...) {
+            ::operator delete(storage);
+            throw;
+        }
+        node->storage = storage;
+        try {
+            nodes_.emplace_back(static_cast<Node*>(node));
+        }
+        catch(...) {
+            NodeDelete{}(node);
+            throw;
+        }
+        return node;
+    }
+
+    template<class Queue>
+    Link<Queue>* link(unsigned producers, Link<Queue>* in) {
+        in->producers_.store(std::max(producers, 1u), X);
+        return in;
+    }
+
+public:
+    explicit Pipeline(std::function<void(unsigned)> on_start = {})
+        : on_start_(std::move(on_start)) {}
+
+    Pipeline(Pipeline const&) = delete;
+    Pipeline& operator=(Pipeline const&) = delete;
+
+    // f(Output<Queue>&) in each of threads threads. queue_args are the arguments of the Queue constructor.
+    template<class Queue, class F, class... QueueArgs>
+    Link<Queue>* source(std::string name, unsigned threads, F f, QueueArgs&&... queue_args) {
+        Link<Queue>* out = link(threads, create<Link<Queue>>(std::forward<QueueArgs>(queue_args)...));
+        stages_.push_back(create<Source<Queue, F>>(std::move(name), threads, *out, std::move(f)));
+        return out;
+    }
+
+    // f(element, Output<Queue>&) for each element of in.
+    template<class Queue, class InQueue, class F, class... QueueArgs>
+    Link<Queue>* stage(std::string name, unsigned threads, Link<InQueue>* in, F f, QueueArgs&&... queue_args) {
+        Link<Queue>* out = link(threads, create<Link<Queue>>(std::forward<QueueArgs>(queue_args)...));
+        Stage* s = create<Transform<InQueue, Queue, F>>(std::move(name), threads, *in, *out, std::move(f));
+        s->capacity = in->queue_.capacity();
+        stages_.push_back(s);
+        return out;
+    }
+
+    // f(element) for each element of in.
+    template<class InQueue, class F>
+    void sink(std::string name, unsigned threads, Link<InQueue>* in, F f) {
+        Stage* s = create<Sink<InQueue, F>>(std::move(name), threads, *in, std::move(f));
+        s->capacity = in->queue_.capacity();
+        stages_.push_back(s);
+    }
+
+    // Runs all the stages and returns when they have ended. Runs once only.
+    void run() {
+        std::vector<std::thread> threads;
+        start_ = Clock::now();
+        for(Stage* stage : stages_)
+            for(unsigned i = 0; i < stage->threads; ++i) {
+                unsigned const thread = static_cast<unsigned>(threads.size());
+                threads.emplace_back([this, stage, thread]() {
+                    if(on_start_)
+                        on_start_(thread);
+                    stage->work();
+                });
+            }
+        for(auto& t : threads)
+            t.join();
+    }
+
+    // Valid after run.
+    std::vector<StageStats> stats() const {
+        std::vector<StageStats> stats;
+        for(Stage const* stage : stages_) {
+            Clock::time_point const end{Clock::duration{stage->end.load(X)}};
+            uint64_t const polls = stage->polls.load(X);
+            double const occupancy = polls && stage->capacity > 0 ? stage->occupancy.load(X) / (polls * stage->capacity) : 0;
+            stats.push_back({stage->name, stage->threads, stage->elements.load(X), std::chrono::duration<double>(end - start_).count(), occupancy});
+        }
+        return stats;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_PIPELINE_H_INCLUDED
@@ -0,0 +1,156 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_QUEUE_STATS_H_INCLUDED
+#define ATOMIC_QUEUE_QUEUE_STATS_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "defs.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A stats policy counts the contention events on the hot paths of the queues. The queues call its static functions:
+//
+// * cas_failure(), when a compare_exchange on head_, tail_ or a slot fails and is retried,
+// * spin(), on every step of the wait strategy while waiting for a slot,
+// * full(), when try_push finds the queue full,
+// * empty(), when try_pop finds the queue empty.
+
+// Counts nothing, the calls compile to nothing. The default.
+struct NoStats {
+    static void cas_failure() noexcept {}
+    static void spin() noexcept {}
+    static void full() noexcept {}
+    static void empty() noexcept {}
+};
+
+struct QueueStats {
+    uint64_t cas_failures = 0;
+    uint64_t spins = 0;
+    uint64_t full = 0;
+    uint64_t empty = 0;
+
+    QueueStats& operator+=(QueueStats const& b) noexcept {
+        cas_failures += b.cas_failures;
+        spins += b.spins;
+        full += b.full;
+        empty += b.empty;
+        return *this;
+    }
+
+    // The events between two snapshots.
+    QueueStats& operator-=(QueueStats const& b) noexcept {
+        cas_failures -= b.cas_failures;
+        spins -= b.spins;
+        full -= b.full;
+        empty -= b.empty;
+        return *this;
+    }
+};
+
+inline QueueStats operator-(QueueStats a, QueueStats const& b) noexcept {
+    return a -= b;
+}
+
+// Counts the events in per-thread counters, so that counting does not add contention. Each thread increments its own counters
+// with a relaxed load and store, rather than an atomic read-modify-write. get() sums the counters of all threads on demand,
+// including the threads which have exited.
+//
+// The counters are per Tag rather than per queue: use a different Tag for each queue to count separately, e.g.
+// AtomicQueue2<T, SIZE, true, true, false, false, SlotLayout::SEPARATE, SpinWait, CountingStats<struct MyQueueTag>>.
+template<class Tag = void>
+class CountingStats {
+    struct Counters {
+        std::atomic<uint64_t> counts[4] = {};
+        Counters* next = nullptr;
+        Counters* prev = nullptr;
+    };
+
+    struct Registry {
+        std::mutex mutex;
+        Counters* threads = nullptr;
+        QueueStats exited; // The counters of the threads which have exited.
+    };
+
+    static Registry& registry() noexcept {
+        static Registry r;
+        return r;
+    }
+
+    static QueueStats load(Counters const& c) noexcept {
+        QueueStats s;
+        s.cas_failures = c.counts[0].load(X);
+        s.spins = c.counts[1].load(X);
+        s.full = c.counts[2].load(X);
+        s.empty = c.counts[3].load(X);
+        return s;
+    }
+
+    // Registers the counters of this thread on its first event and unregisters them on thread exit.
+    struct ThreadCounters : Counters {
+        ThreadCounters() {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            if((this->next = r.threads))
+                r.threads->prev = this;
+            r.threads = this;
+        }
+
+        ~ThreadCounters() noexcept {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.exited += load(*this);
+            if(this->next)
+                this->next->prev = this->prev;
+            (this->prev ? this->prev->next : r.threads) = this->next;
+        }
+    };
+
+    static void increment(unsigned i) noexcept {
+        static thread_local ThreadCounters counters;
+        std::atomic<uint64_t>& count = counters.counts[i];
+        count.store(count.load(X) + 1, X);
+    }
+
+public:
+    static void cas_failure() noexcept {
+        increment(0);
+    }
+
+    static void spin() noexcept {
+        increment(1);
+    }
+
+    static void full() noexcept {
+        increment(2);
+    }
+
+    static void empty() noexcept {
+        increment(3);
+    }
+
+    // The sum of the counters of all threads. Take the difference of two snapshots for the events in between.
+    static QueueStats get() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        QueueStats s = r.exited;
+        for(Counters const* c = r.threads; c; c = c->next)
+            s += load(*c);
+        return s;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_QUEUE_STATS_H_INCLUDED
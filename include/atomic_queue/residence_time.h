@@ -0,0 +1,245 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_RESIDENCE_TIME_H_INCLUDED
+#define ATOMIC_QUEUE_RESIDENCE_TIME_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "defs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#if !defined(__x86_64__) && !defined(__i386__) && !defined(__aarch64__)
+#include <chrono>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The time stamp counter, in TSC ticks of cpu_base_frequency() GHz on x86. The generic timer ticks of CNTFRQ_EL0 Hz on AArch64,
+// nanoseconds elsewhere.
+inline uint64_t read_tsc() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A log-linear histogram of TSC tick counts: values below 2^SUB_BITS have a bucket each, the greater ones 2^SUB_BITS buckets per
+// power of 2, so that the relative error of a percentile is under 2^-SUB_BITS.
+//
+// One thread records, any thread can read it concurrently. record does a relaxed load and store of the bucket counter rather
+// than an atomic read-modify-write, which is why there is one histogram per consumer. add merges a histogram into another one
+// with fetch_add, so that several threads can add into one histogram.
+class ResidenceHistogram {
+public:
+    static constexpr unsigned SUB_BITS = 4;
+    static constexpr unsigned SUB_BUCKETS = 1u << SUB_BITS;
+    static constexpr unsigned BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+private:
+    std::atomic<uint64_t> counts_[BUCKETS] = {};
+
+public:
+    static unsigned bucket(uint64_t ticks) noexcept {
+        if(ticks < SUB_BUCKETS)
+            return ticks;
+        unsigned const shift = 63 - __builtin_clzll(ticks) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<unsigned>(ticks >> shift) - SUB_BUCKETS;
+    }
+
+    // The greatest value of a bucket.
+    static uint64_t bucket_max(unsigned b) noexcept {
+        unsigned const group = b / SUB_BUCKETS;
+        if(!group)
+            return b;
+        unsigned const shift = group - 1;
+        uint64_t const min = static_cast<uint64_t>(SUB_BUCKETS + b % SUB_BUCKETS) << shift;
+        return min + ((uint64_t{1} << shift) - 1);
+    }
+
+    void record(uint64_t ticks) noexcept {
+        std::atomic<uint64_t>& count = counts_[bucket(ticks)];
+        count.store(count.load(X) + 1, X);
+    }
+
+    void add(ResidenceHistogram const& b) noexcept {
+        for(unsigned i = 0; i < BUCKETS; ++i)
+            if(uint64_t n = b.counts_[i].load(X))
+                counts_[i].fetch_add(n, X);
+    }
+
+    uint64_t count() const noexcept {
+        uint64_t n = 0;
+        for(auto& count : counts_)
+            n += count.load(X);
+        return n;
+    }
+
+    // The upper bound of the q-th quantile, q in [0, 1], e.g. 0.5, 0.99, 0.999. 0 when empty.
+    uint64_t percentile(double q) const noexcept {
+        uint64_t counts[BUCKETS];
+        uint64_t total = 0;
+        for(unsigned i = 0; i < BUCKETS; ++i)
+            total += counts[i] = counts_[i].load(X);
+        if(!total)
+            return 0;
+        uint64_t const rank = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(q * total)), 1);
+        uint64_t n = 0;
+        for(unsigned i = 0; i < BUCKETS; ++i)
+            if((n += counts[i]) >= rank)
+                return bucket_max(i);
+        return bucket_max(BUCKETS - 1);
+    }
+
+    void reset() noexcept {
+        for(auto& count : counts_)
+            count.store(0, X);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct TscNow {};
+
+// A queue element with the time stamp of its push.
+template<class T>
+struct TscStamped {
+    T value;
+    uint64_t tsc;
+
+    TscStamped() noexcept = default;
+
+    // Reads the time stamp counter after the element is stored.
+    template<class U>
+    TscStamped(U&& v, TscNow) noexcept
+        : value(std::forward<U>(v))
+        , tsc(read_tsc()) {}
+};
+
+namespace details {
+
+template<class T>
+struct Unstamped {
+    using type = T;
+    static constexpr bool stamped = false;
+};
+
+template<class T>
+struct Unstamped<TscStamped<T>> {
+    using type = T;
+    static constexpr bool stamped = true;
+};
+
+} // namespace details
+
+// Records the time the elements spend in the queue, from the end of push to the start of pop, into a histogram per consumer.
+// Queue is AtomicQueue2 or AtomicQueueB2 of TscStamped<T> elements: push stamps the element in its slot with emplace and pop
+// records the residence time while the element is still in its slot with consume. For other element types the histogram is
+// not touched and ResidenceTimeQueue<Queue> compiles to Queue push and pop, so that the measurement can be switched off with
+// the element type, e.g.:
+//
+//     using Element = std::conditional<MEASURE, TscStamped<Message>, Message>::type;
+//     ResidenceTimeQueue<AtomicQueue2<Element, 1024>> q;
+//     ResidenceHistogram h; // One per consumer.
+//     q.push(message);
+//     Message m = q.pop(h);
+//     uint64_t p99 = h.percentile(.99); // In TSC ticks, divide by cpu_base_frequency() GHz for nanoseconds.
+template<class Queue>
+struct ResidenceTimeQueue : Queue {
+    using T = typename details::Unstamped<typename Queue::value_type>::type;
+    using value_type = T;
+    static constexpr bool stamped = details::Unstamped<typename Queue::value_type>::stamped;
+
+    using Queue::Queue;
+
+    template<class U>
+    void push(U&& element) noexcept {
+        push_(std::forward<U>(element), std::integral_constant<bool, stamped>{});
+    }
+
+    template<class U>
+    bool try_push(U&& element) noexcept {
+        return try_push_(std::forward<U>(element), std::integral_constant<bool, stamped>{});
+    }
+
+    T pop(ResidenceHistogram& histogram) noexcept {
+        return pop_(histogram, std::integral_constant<bool, stamped>{});
+    }
+
+    bool try_pop(T& element, ResidenceHistogram& histogram) noexcept {
+        return try_pop_(element, histogram, std::integral_constant<bool, stamped>{});
+    }
+
+private:
+    struct Consume {
+        T& element;
+        ResidenceHistogram& histogram;
+
+        void operator()(TscStamped<T>& e) const noexcept {
+            uint64_t const now = read_tsc();
+            histogram.record(now > e.tsc ? now - e.tsc : 0); // TSC of another CPU can be a little ahead.
+            element = std::move(e.value);
+        }
+    };
+
+    template<class U>
+    void push_(U&& element, std::true_type) noexcept {
+        this->Queue::emplace(std::forward<U>(element), TscNow{});
+    }
+
+    template<class U>
+    void push_(U&& element, std::false_type) noexcept {
+        this->Queue::push(std::forward<U>(element));
+    }
+
+    template<class U>
+    bool try_push_(U&& element, std::true_type) noexcept {
+        return this->Queue::try_emplace(std::forward<U>(element), TscNow{});
+    }
+
+    template<class U>
+    bool try_push_(U&& element, std::false_type) noexcept {
+        return this->Queue::try_push(std::forward<U>(element));
+    }
+
+    T pop_(ResidenceHistogram& histogram, std::true_type) noexcept {
+        T element;
+        this->Queue::consume(Consume{element, histogram});
+        return element;
+    }
+
+    T pop_(ResidenceHistogram&, std::false_type) noexcept {
+        return this->Queue::pop();
+    }
+
+    bool try_pop_(T& element, ResidenceHistogram& histogram, std::true_type) noexcept {
+        return this->Queue::try_consume(Consume{element, histogram});
+    }
+
+    bool try_pop_(T& element, ResidenceHistogram&, std::false_type) noexcept {
+        return this->Queue::try_pop(element);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_RESIDENCE_TIME_H_INCLUDED
@@ -0,0 +1,192 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_SELECTOR_H_INCLUDED
+#define ATOMIC_QUEUE_SELECTOR_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+
+#include <cassert>
+#include <cstdint>
+#include <utility>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class WAIT>
+class Selector;
+
+// A queue which sets its bit in the readiness bitmap of a Selector when an element is pushed into it while its bit is clear,
+// i.e. after a consumer has found it empty. A push with the bit set costs a full fence and a load of the bitmap cache line,
+// which stays shared while the queue is non-empty.
+template<class Queue>
+class SelectableQueue : public Queue {
+    template<class>
+    friend class Selector;
+
+    std::atomic<uint64_t>* ready_ = nullptr;
+    uint64_t bit_ = 0;
+    void (*wake_)(std::atomic<uint64_t>&) = nullptr;
+
+    void signal() noexcept {
+        if(ready_) {
+            // Either this thread sees the bit cleared by a consumer, or the consumer sees the element pushed.
+            std::atomic_thread_fence(C);
+            if(ATOMIC_QUEUE_UNLIKELY(!(ready_->load(X) & bit_))) {
+                ready_->fetch_or(bit_, R);
+                wake_(*ready_);
+            }
+        }
+    }
+
+public:
+    using Queue::Queue;
+
+    template<class T>
+    bool try_push(T&& element) noexcept {
+        if(!Queue::try_push(std::forward<T>(element)))
+            return false;
+        signal();
+        return true;
+    }
+
+    template<class T>
+    void push(T&& element) noexcept {
+        Queue::push(std::forward<T>(element));
+        signal();
+    }
+
+    template<class... Args>
+    bool try_emplace(Args&&... args) noexcept {
+        if(!Queue::try_emplace(std::forward<Args>(args)...))
+            return false;
+        signal();
+        return true;
+    }
+
+    template<class... Args>
+    void emplace(Args&&... args) noexcept {
+        Queue::emplace(std::forward<Args>(args)...);
+        signal();
+    }
+
+    template<class ForwardIt>
+    unsigned try_push_n(ForwardIt first, ForwardIt last) noexcept {
+        unsigned const n = Queue::try_push_n(first, last);
+        if(n)
+            signal();
+        return n;
+    }
+
+    template<class ForwardIt>
+    void push_n(ForwardIt first, ForwardIt last) noexcept {
+        if(first != last) {
+            Queue::push_n(first, last);
+            signal();
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Waits for any of up to 64 SelectableQueues to become non-empty, rather than polling try_pop of each in turn, e.g.:
+//
+//     SelectableQueue<AtomicQueue2<Command, 64>> control;
+//     SelectableQueue<AtomicQueueB2<Message>> data(4096);
+//     Selector<AtomicWait<>> selector;
+//     unsigned const c = selector.add(control); // 0
+//     selector.add(data);                       // 1
+//     for(;;)
+//         if(selector.select() == c) { if(control.try_pop(command)) ...; }
+//         else if(data.try_pop(message)) ...;
+//
+// A readiness bitmap has a bit per queue, which the queue sets on its empty-to-non-empty transition. select returns the lowest
+// set bit with one load and a count of trailing zeros, no matter how many queues there are, so the queues added first take
+// priority. The bit stays set until a consumer finds the queue empty and clears it. With no bits set select waits with WAIT,
+// e.g. SpinWait, or AtomicWait to spin and then block in the kernel, and the queue which sets a bit notifies it.
+//
+// Several consumers may share a selector, then the queue selected may be emptied by another consumer, try_pop it rather than
+// pop. Add the queues before the producers and consumers start.
+template<class WAIT = SpinWait>
+class Selector {
+public:
+    static constexpr unsigned MAX_QUEUES = 64;
+
+private:
+    struct Entry {
+        void const* queue;
+        bool (*was_empty)(void const*);
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> ready_ = {0};
+    alignas(CACHE_LINE_SIZE) Entry queues_[MAX_QUEUES];
+    unsigned size_ = 0;
+
+    static void wake(std::atomic<uint64_t>& ready) noexcept {
+        WAIT::notify(ready);
+    }
+
+public:
+    Selector() noexcept = default;
+    Selector(Selector const&) = delete;
+    Selector& operator=(Selector const&) = delete;
+
+    // Returns the index of the queue, the order of the add calls.
+    template<class Queue>
+    unsigned add(SelectableQueue<Queue>& q) noexcept {
+        assert(size_ < MAX_QUEUES);
+        assert(!q.ready_); // A queue belongs to one selector only.
+        unsigned const index = size_++;
+        queues_[index] = {&q, [](void const* p) { return static_cast<SelectableQueue<Queue> const*>(p)->was_empty(); }};
+        q.bit_ = uint64_t{1} << index;
+        q.wake_ = wake;
+        q.ready_ = &ready_;
+        if(!q.was_empty())
+            ready_.fetch_or(q.bit_, R);
+        return index;
+    }
+
+    // The index of a queue which was non-empty, -1 when all queues were empty.
+    int try_select() noexcept {
+        for(uint64_t ready = ready_.load(A); ready; ready &= ready - 1) {
+            unsigned const index = __builtin_ctzll(ready);
+            Entry const& e = queues_[index];
+            if(!e.was_empty(e.queue))
+                return index;
+            uint64_t const bit = uint64_t{1} << index;
+            ready_.fetch_and(~bit, X);
+            std::atomic_thread_fence(C); // Either this thread sees the element pushed, or the pushing thread sees the bit cleared.
+            if(!e.was_empty(e.queue)) {
+                ready_.fetch_or(bit, X);
+                return index;
+            }
+        }
+        return -1;
+    }
+
+    // The index of a queue which was non-empty, waits while all queues are empty.
+    unsigned select() noexcept {
+        WAIT wait;
+        for(;;) {
+            int const index = try_select();
+            if(index >= 0)
+                return index;
+            wait.wait_while(ready_, uint64_t{0});
+        }
+    }
+
+    unsigned size() const noexcept {
+        return size_;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_SELECTOR_H_INCLUDED
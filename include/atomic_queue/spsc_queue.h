@@ -0,0 +1,166 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_SPSC_QUEUE_H_INCLUDED
+#define ATOMIC_QUEUE_SPSC_QUEUE_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A fixed size ring-buffer for one producer and one consumer. Unlike AtomicQueue2 with SPSC=true, there is no per-slot state:
+// the producer and the consumer communicate only through head_ and tail_. Each side keeps a cached copy of the other side's
+// index and only reloads it when the queue appears full or empty, so that in the steady state the producer and the consumer
+// do not touch each other's cache lines.
+//
+// Each side publishes its index every PUBLISH_BATCH operations, and whenever it finds the queue full or empty. With
+// PUBLISH_BATCH greater than 1 the producer must call flush() when it has no more elements to push for a while, otherwise the
+// consumer may not see up to PUBLISH_BATCH - 1 of the last elements pushed.
+template<class T, unsigned SIZE, unsigned PUBLISH_BATCH = 1>
+class SpscAtomicQueue {
+    static constexpr unsigned size_ = details::round_up_to_power_of_2(SIZE);
+    static_assert(PUBLISH_BATCH && PUBLISH_BATCH <= size_, "PUBLISH_BATCH must be in [1, capacity].");
+
+    struct alignas(CACHE_LINE_SIZE) Side {
+        unsigned index = 0;        // The next element to push or pop.
+        unsigned published = 0;    // The index last stored into head_ or tail_.
+        unsigned cached_other = 0; // The last loaded value of the other side's index.
+    };
+
+    // Put these on different cache lines to avoid false sharing between the producer and the consumer.
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> head_ = {};
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> tail_ = {};
+    Side producer_;
+    Side consumer_;
+    alignas(CACHE_LINE_SIZE) T elements_[size_] = {};
+
+    void publish_head(unsigned head) noexcept {
+        producer_.published = head;
+        head_.store(head, R);
+    }
+
+    void publish_tail(unsigned tail) noexcept {
+        consumer_.published = tail;
+        tail_.store(tail, R);
+    }
+
+    bool wait_free_slot(unsigned head) noexcept {
+        if(ATOMIC_QUEUE_UNLIKELY(head - producer_.cached_other == size_)) {
+            producer_.cached_other = tail_.load(A);
+            if(head - producer_.cached_other == size_) {
+                if(producer_.published != head)
+                    publish_head(head); // Let the consumer see all the elements before waiting for it.
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template<class U>
+    void do_push(U&& element, unsigned head) noexcept {
+        elements_[head % size_] = std::forward<U>(element);
+        ++head;
+        producer_.index = head;
+        if(head - producer_.published >= PUBLISH_BATCH)
+            publish_head(head);
+    }
+
+    bool wait_element(unsigned tail) noexcept {
+        if(ATOMIC_QUEUE_UNLIKELY(tail == consumer_.cached_other)) {
+            consumer_.cached_other = head_.load(A);
+            if(tail == consumer_.cached_other) {
+                if(consumer_.published != tail)
+                    publish_tail(tail); // Let the producer reuse all the slots before waiting for it.
+                return false;
+            }
+        }
+        return true;
+    }
+
+    T do_pop(unsigned tail) noexcept {
+        T element{std::move(elements_[tail % size_])};
+        ++tail;
+        consumer_.index = tail;
+        if(tail - consumer_.published >= PUBLISH_BATCH)
+            publish_tail(tail);
+        return element;
+    }
+
+public:
+    using value_type = T;
+
+    SpscAtomicQueue() noexcept = default;
+    SpscAtomicQueue(SpscAtomicQueue const&) = delete;
+    SpscAtomicQueue& operator=(SpscAtomicQueue const&) = delete;
+
+    // The producer side.
+
+    template<class U>
+    bool try_push(U&& element) noexcept {
+        unsigned head = producer_.index;
+        if(!wait_free_slot(head))
+            return false;
+        do_push(std::forward<U>(element), head);
+        return true;
+    }
+
+    template<class U>
+    void push(U&& element) noexcept {
+        unsigned head = producer_.index;
+        while(!wait_free_slot(head))
+            spin_loop_pause();
+        do_push(std::forward<U>(element), head);
+    }
+
+    // Makes all the pushed elements visible to the consumer.
+    void flush() noexcept {
+        if(producer_.published != producer_.index)
+            publish_head(producer_.index);
+    }
+
+    // The consumer side.
+
+    bool try_pop(T& element) noexcept {
+        unsigned tail = consumer_.index;
+        if(!wait_element(tail))
+            return false;
+        element = do_pop(tail);
+        return true;
+    }
+
+    T pop() noexcept {
+        unsigned tail = consumer_.index;
+        while(!wait_element(tail))
+            spin_loop_pause();
+        return do_pop(tail);
+    }
+
+    // Only counts the published elements.
+    unsigned was_size() const noexcept {
+        return head_.load(X) - tail_.load(X);
+    }
+
+    bool was_empty() const noexcept {
+        return !was_size();
+    }
+
+    bool was_full() const noexcept {
+        return was_size() >= size_;
+    }
+
+    static constexpr unsigned capacity() noexcept {
+        return size_;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_SPSC_QUEUE_H_INCLUDED
@@ -0,0 +1,255 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_UNBOUNDED_QUEUE_H_INCLUDED
+#define ATOMIC_QUEUE_UNBOUNDED_QUEUE_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+#include "spinlock.h"
+
+#include <new>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// An unbounded multiple-producer-multiple-consumer queue for non-atomic elements: a linked list of segments of SEGMENT_SIZE
+// slots each. Producers and consumers claim slots with fetch_add on the segment indices, as in LCRQ/LPRQ. Unlike those, a
+// segment is not a ring-buffer: each slot is used once, and a producer that claims an index past the end of the segment
+// appends a new segment.
+//
+// Drained segments go into a free pool and are reused for new segments, so that in the steady state push and pop do not
+// allocate. push may only throw std::bad_alloc when the pool is empty.
+//
+// A thread holds a reference to the segment it works on, which it validates against the current segment pointer after taking.
+// A segment is only reused once it is no longer current for producers and consumers and has no references. The memory of the
+// segments is only freed by the destructor, so that a thread with a stale segment pointer can take and drop a reference safely.
+template<class T, unsigned SEGMENT_SIZE = 1024>
+class UnboundedQueue {
+    static_assert(SEGMENT_SIZE, "SEGMENT_SIZE must be positive.");
+
+    enum State : unsigned char { EMPTY, STORED };
+
+    struct Segment {
+        alignas(CACHE_LINE_SIZE) std::atomic<unsigned> head = {}; // Producer index.
+        alignas(CACHE_LINE_SIZE) std::atomic<unsigned> tail = {}; // Consumer index.
+        alignas(CACHE_LINE_SIZE) std::atomic<unsigned> references = {};
+        std::atomic<Segment*> next = {nullptr};
+        Segment* pool_next = nullptr; // Protected by pool_lock_.
+        unsigned char* storage;
+        alignas(CACHE_LINE_SIZE) std::atomic<unsigned char> states[SEGMENT_SIZE] = {};
+        alignas(CACHE_LINE_SIZE) T elements[SEGMENT_SIZE] = {};
+
+        void reset() noexcept {
+            head.store(0, X);
+            tail.store(0, X);
+            next.store(nullptr, X);
+            for(auto& state : states)
+                state.store(EMPTY, X);
+        }
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<Segment*> producer_segment_;
+    alignas(CACHE_LINE_SIZE) std::atomic<Segment*> consumer_segment_;
+    alignas(CACHE_LINE_SIZE) Spinlock pool_lock_;
+    Segment* pool_ = nullptr;
+
+    // Allocated with operator new and aligned here, because C++14 new does not support over-aligned types.
+    static Segment* new_segment() {
+        auto storage = static_cast<unsigned char*>(::operator new(sizeof(Segment) + alignof(Segment) - 1));
+        Segment* segment = new(details::align_up(storage, alignof(Segment))) Segment;
+        segment->storage = storage;
+        return segment;
+    }
+
+    static void delete_segment(Segment* segment) noexcept {
+        unsigned char* storage = segment->storage;
+        segment->~Segment();
+        ::operator delete(storage);
+    }
+
+    Segment* allocate_segment() {
+        {
+            Spinlock::scoped_lock lock(pool_lock_);
+            // Skip the segments still referenced by threads which have not noticed yet that the segments were retired.
+            for(Segment** p = &pool_; *p; p = &(*p)->pool_next) {
+                Segment* segment = *p;
+                if(!segment->references.load(C)) {
+                    *p = segment->pool_next;
+                    segment->reset();
+                    return segment;
+                }
+            }
+        }
+        return new_segment();
+    }
+
+    void free_segment(Segment* segment) noexcept {
+        Spinlock::scoped_lock lock(pool_lock_);
+        segment->pool_next = pool_;
+        pool_ = segment;
+    }
+
+    static Segment* acquire(std::atomic<Segment*>& current) noexcept {
+        for(;;) {
+            Segment* segment = current.load(C);
+            segment->references.fetch_add(1, C);
+            if(ATOMIC_QUEUE_LIKELY(current.load(C) == segment))
+                return segment;
+            segment->references.fetch_sub(1, R); // Retired meanwhile.
+        }
+    }
+
+    static void release(Segment* segment) noexcept {
+        segment->references.fetch_sub(1, R);
+    }
+
+    Segment* append_segment(Segment* segment) {
+        Segment* next = segment->next.load(A);
+        if(!next) {
+            Segment* expected = nullptr;
+            next = allocate_segment();
+            if(!segment->next.compare_exchange_strong(expected, next, AR, A)) {
+                free_segment(next); // Another producer appended first.
+                next = expected;
+            }
+        }
+        producer_segment_.compare_exchange_strong(segment, next, C, X);
+        return next;
+    }
+
+    void advance_consumer(Segment* segment, Segment* next) noexcept {
+        // Move producer_segment_ past segment first, so that consumer_segment_ never gets ahead of producer_segment_.
+        Segment* expected = segment;
+        producer_segment_.compare_exchange_strong(expected, next, C, X);
+        expected = segment;
+        if(consumer_segment_.compare_exchange_strong(expected, next, C, X))
+            free_segment(segment); // Reused once the threads still holding it release it.
+    }
+
+    T take(Segment* segment, unsigned index) noexcept {
+        auto& state = segment->states[index];
+        while(ATOMIC_QUEUE_UNLIKELY(state.load(A) != STORED)) // Wait for the producer that claimed this index.
+            spin_loop_pause();
+        return T{std::move(segment->elements[index])};
+    }
+
+public:
+    using value_type = T;
+
+    // Puts extra_segments segments into the pool to avoid allocating during the initial bursts.
+    explicit UnboundedQueue(unsigned extra_segments = 0) {
+        Segment* segment = new_segment();
+        producer_segment_.store(segment, X);
+        consumer_segment_.store(segment, X);
+        while(extra_segments--)
+            free_segment(new_segment());
+    }
+
+    UnboundedQueue(UnboundedQueue const&) = delete;
+    UnboundedQueue& operator=(UnboundedQueue const&) = delete;
+
+    // Not thread-safe.
+    ~UnboundedQueue() noexcept {
+        for(Segment *s = consumer_segment_.load(X), *next; s; s = next) {
+            next = s->next.load(X);
+            delete_segment(s);
+        }
+        for(Segment *s = pool_, *next; s; s = next) {
+            next = s->pool_next;
+            delete_segment(s);
+        }
+    }
+
+    template<class U>
+    void push(U&& element) {
+        for(;;) {
+            Segment* segment = acquire(producer_segment_);
+            unsigned head = segment->head.fetch_add(1, X);
+            if(ATOMIC_QUEUE_LIKELY(head < SEGMENT_SIZE)) {
+                segment->elements[head] = std::forward<U>(element);
+                segment->states[head].store(STORED, R);
+                release(segment);
+                return;
+            }
+            try {
+                append_segment(segment);
+            }
+            catch(...) {
+                release(segment);
+                throw;
+            }
+            release(segment);
+        }
+    }
+
+    // Never fails, provided for compatibility with the bounded queues.
+    template<class U>
+    bool try_push(U&& element) {
+        push(std::forward<U>(element));
+        return true;
+    }
+
+    // Busy-waits when the queue is empty.
+    T pop() noexcept {
+        for(;;) {
+            Segment* segment = acquire(consumer_segment_);
+            unsigned tail = segment->tail.fetch_add(1, X);
+            if(ATOMIC_QUEUE_LIKELY(tail < SEGMENT_SIZE)) {
+                T element = take(segment, tail);
+                release(segment);
+                return element;
+            }
+            Segment* next;
+            while(!(next = segment->next.load(A)))
+                spin_loop_pause();
+            advance_consumer(segment, next);
+            release(segment);
+        }
+    }
+
+    bool try_pop(T& element) noexcept {
+        for(;;) {
+            Segment* segment = acquire(consumer_segment_);
+            unsigned tail = segment->tail.load(X);
+            while(tail < SEGMENT_SIZE) {
+                if(static_cast<int>(std::min(segment->head.load(X), SEGMENT_SIZE) - tail) <= 0) {
+                    release(segment);
+                    return false;
+                }
+                if(segment->tail.compare_exchange_weak(tail, tail + 1, X, X)) {
+                    element = take(segment, tail);
+                    release(segment);
+                    return true;
+                }
+            }
+            Segment* next = segment->next.load(A);
+            if(next)
+                advance_consumer(segment, next);
+            release(segment);
+            if(!next)
+                return false;
+        }
+    }
+
+    bool was_empty() const noexcept {
+        Segment* segment = consumer_segment_.load(X);
+        // The segment may be retired meanwhile, its indices are still readable.
+        unsigned tail = segment->tail.load(X);
+        return tail >= std::min(segment->head.load(X), SEGMENT_SIZE) && (tail < SEGMENT_SIZE || !segment->next.load(X));
+    }
+
+    static constexpr unsigned segment_size() noexcept {
+        return SEGMENT_SIZE;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_UNBOUNDED_QUEUE_H_INCLUDED
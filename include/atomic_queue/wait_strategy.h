@@ -0,0 +1,199 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_WAIT_STRATEGY_H_INCLUDED
+#define ATOMIC_QUEUE_WAIT_STRATEGY_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "defs.h"
+
+#include <algorithm>
+#include <thread>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define ATOMIC_QUEUE_WAITPKG 1
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A wait strategy decides what a thread does while it waits for a queue slot to be stored into or loaded from. The queues
+// construct one WAIT object per waiting operation and call:
+//
+// * wait_while(a, value), when it waits for a to change from value,
+// * wait_until(a, value), when it waits for a to become value,
+//
+// repeatedly until the slot is ready. Either may return early, or spuriously. After storing into a slot the queues call
+// WAIT::notify(a), which only strategies which block in the kernel need.
+
+namespace details {
+
+// For the strategies which never block: each wait is just one step of the strategy.
+template<class Derived>
+struct SpinningWait {
+    template<class T>
+    void wait_while(std::atomic<T>&, T) noexcept {
+        static_cast<Derived&>(*this).step();
+    }
+
+    template<class T>
+    void wait_until(std::atomic<T>&, T) noexcept {
+        static_cast<Derived&>(*this).step();
+    }
+
+    template<class T>
+    static void notify(std::atomic<T>&) noexcept {}
+};
+
+} // namespace details
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Busy-waits with spin_loop_pause. The lowest latency, burns a CPU while waiting. The default.
+struct SpinWait : details::SpinningWait<SpinWait> {
+    void step() noexcept {
+        spin_loop_pause();
+    }
+};
+
+// Busy-waits for SPINS steps, then yields the CPU to other threads on every step. Suits oversubscribed hosts, where the thread
+// being waited for may need this CPU to make progress.
+template<unsigned SPINS = 128>
+struct SpinYieldWait : details::SpinningWait<SpinYieldWait<SPINS>> {
+    unsigned spins = 0;
+
+    void step() noexcept {
+        if(spins < SPINS) {
+            ++spins;
+            spin_loop_pause();
+        }
+        else {
+            std::this_thread::yield(); // sched_yield on Linux.
+        }
+    }
+};
+
+// Doubles the number of spin_loop_pause per step up to MAX_PAUSES, to reduce the contention on the slot cache line.
+template<unsigned MAX_PAUSES = 1024>
+struct BackoffWait : details::SpinningWait<BackoffWait<MAX_PAUSES>> {
+    unsigned pauses = 1;
+
+    void step() noexcept {
+        for(unsigned i = pauses; i--;)
+            spin_loop_pause();
+        pauses = std::min(pauses * 2, MAX_PAUSES);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace details {
+
+#ifdef ATOMIC_QUEUE_WAITPKG
+inline bool has_waitpkg() noexcept {
+    static bool const supported = [] {
+        unsigned eax, ebx, ecx, edx;
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 5)); // CPUID.(EAX=07H, ECX=0H):ECX.WAITPKG[bit 5]
+    }();
+    return supported;
+}
+
+// The light C0.1 state wakes up faster than C0.2. The OS caps the wait time at IA32_UMWAIT_CONTROL.
+__attribute__((target("waitpkg"))) inline void umwait(unsigned cycles) noexcept {
+    _umwait(1, __rdtsc() + cycles);
+}
+
+__attribute__((target("waitpkg"))) inline void umonitor(void const* address) noexcept {
+    _umonitor(const_cast<void*>(address));
+}
+#endif
+
+} // namespace details
+
+// Busy-waits for SPINS steps, then waits in the light power-saving state of umonitor/umwait for the slot cache line to be
+// written, for at most TIMEOUT_CYCLES TSC cycles at a time. Frees the execution resources for the sibling hyper-thread and saves
+// power while still waking up within a fraction of a microsecond. Falls back to spin_loop_pause on CPUs without WAITPKG, detected
+// at run-time, and on other architectures.
+template<unsigned SPINS = 64, unsigned TIMEOUT_CYCLES = 100000>
+struct UmwaitWait {
+    unsigned spins = 0;
+
+    template<class T>
+    void wait_while(std::atomic<T>& a, T value) noexcept {
+#ifdef ATOMIC_QUEUE_WAITPKG
+        if(spins >= SPINS && details::has_waitpkg()) {
+            details::umonitor(&a);
+            if(a.load(X) == value) // Check after arming the monitor to not miss the store.
+                details::umwait(TIMEOUT_CYCLES);
+            return;
+        }
+        ++spins;
+#else
+        static_cast<void>(a);
+        static_cast<void>(value);
+#endif
+        spin_loop_pause();
+    }
+
+    template<class T>
+    void wait_until(std::atomic<T>& a, T value) noexcept {
+        T observed = a.load(X);
+        if(observed != value)
+            wait_while(a, observed);
+    }
+
+    template<class T>
+    static void notify(std::atomic<T>&) noexcept {} // umwait wakes up on stores into the monitored cache line.
+};
+
+// Busy-waits for SPINS steps, then blocks in std::atomic<T>::wait, which is a futex on Linux, until a store notifies it. The
+// highest wake-up latency and no CPU burn while blocked. Every store into a slot calls notify_all, which is cheap with no
+// waiters. Before C++20 std::atomic<T>::wait is unavailable and this yields instead, like SpinYieldWait.
+template<unsigned SPINS = 128>
+struct AtomicWait {
+    unsigned spins = 0;
+
+    template<class T>
+    void wait_while(std::atomic<T>& a, T value) noexcept {
+        if(spins < SPINS) {
+            ++spins;
+            spin_loop_pause();
+            return;
+        }
+#if defined(__cpp_lib_atomic_wait) && __cpp_lib_atomic_wait >= 201907L
+        a.wait(value, X);
+#else
+        static_cast<void>(a);
+        static_cast<void>(value);
+        std::this_thread::yield();
+#endif
+    }
+
+    template<class T>
+    void wait_until(std::atomic<T>& a, T value) noexcept {
+        T observed = a.load(X);
+        if(observed != value)
+            wait_while(a, observed);
+    }
+
+    template<class T>
+    static void notify(std::atomic<T>& a) noexcept {
+#if defined(__cpp_lib_atomic_wait) && __cpp_lib_atomic_wait >= 201907L
+        a.notify_all(); // Consumers of different laps may wait on the same slot.
+#else
+        static_cast<void>(a);
+#endif
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_WAIT_STRATEGY_H_INCLUDED
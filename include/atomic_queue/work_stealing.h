@@ -0,0 +1,307 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+#ifndef ATOMIC_QUEUE_WORK_STEALING_H_INCLUDED
+#define ATOMIC_QUEUE_WORK_STEALING_H_INCLUDED
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+#include "atomic_queue.h"
+
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace atomic_queue {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A fixed size Chase-Lev work-stealing deque, with the memory orders of "Correct and Efficient Work-Stealing for Weak Memory
+// Models" by Lê, Pop, Cohen and Zappa Nardelli. The owner thread pushes and takes at the bottom, LIFO, without atomic
+// read-modify-write instructions unless it takes the last element. Any thread steals at the top, FIFO, with one
+// compare_exchange.
+//
+// T is a pointer or another lock-free atomic type, because a thief may load an element the owner is overwriting and only
+// discards it after its compare_exchange fails. push fails when the deque is full, rather than growing the array.
+template<class T, unsigned SIZE = 1024>
+class ChaseLevDeque {
+    static_assert(SIZE && !(SIZE & (SIZE - 1)), "SIZE must be a power of 2.");
+
+    // Signed, because take decrements bottom_ below top_ when the deque is empty.
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> top_ = {};    // Stored into by the thieves and the owner.
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> bottom_ = {}; // Stored into by the owner only.
+    alignas(CACHE_LINE_SIZE) std::atomic<T> elements_[SIZE] = {};
+
+public:
+    using value_type = T;
+
+    ChaseLevDeque() noexcept = default;
+    ChaseLevDeque(ChaseLevDeque const&) = delete;
+    ChaseLevDeque& operator=(ChaseLevDeque const&) = delete;
+
+    // The owner only.
+    bool push(T element) noexcept {
+        int64_t b = bottom_.load(X);
+        if(b - top_.load(A) >= static_cast<int64_t>(SIZE))
+            return false;
+        elements_[b & (SIZE - 1)].store(element, X);
+        bottom_.store(b + 1, R);
+        return true;
+    }
+
+    // The owner only.
+    bool take(T& element) noexcept {
+        int64_t b = bottom_.load(X) - 1;
+        bottom_.store(b, X);
+        std::atomic_thread_fence(C); // Either take or a concurrent steal sees the other's index.
+        int64_t t = top_.load(X);
+        if(t > b) {
+            bottom_.store(b + 1, X);
+            return false;
+        }
+        element = elements_[b & (SIZE - 1)].load(X);
+        if(t == b) { // The last element, the thieves may race for it.
+            bool const taken = top_.compare_exchange_strong(t, t + 1, C, X);
+            bottom_.store(b + 1, X);
+            return taken;
+        }
+        return true;
+    }
+
+    // Any thread. Fails when the deque is empty or another thief or the owner has won the race for the element.
+    bool steal(T& element) noexcept {
+        int64_t t = top_.load(A);
+        std::atomic_thread_fence(C);
+        int64_t b = bottom_.load(A);
+        if(t >= b)
+            return false;
+        T e = elements_[t & (SIZE - 1)].load(X);
+        if(!top_.compare_exchange_strong(t, t + 1, C, X))
+            return false;
+        element = e;
+        return true;
+    }
+
+    unsigned was_size() const noexcept {
+        return static_cast<unsigned>(std::max<int64_t>(bottom_.load(X) - top_.load(X), 0));
+    }
+
+    static constexpr unsigned capacity() noexcept {
+        return SIZE;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A task executor with a Chase-Lev deque per worker thread and a global injection queue, so that the workers do not contend
+// on the head_ and tail_ of one shared queue.
+//
+// submit from a worker thread pushes the task into the deque of that worker, the worker takes its own tasks LIFO. Tasks
+// submitted from other threads go into the injection queue, an AtomicQueueB2 of injection_capacity tasks; submit waits while
+// it is full. An idle worker takes from its deque, then from the injection queue, then steals from the other workers in
+// random order. A full deque overflows into the injection queue, then the task runs in place. Idle workers spin and then
+// yield, like SpinYieldWait, rather than block.
+//
+// on_start(worker_index) runs in each worker thread before it runs any task, e.g. to pin it to a CPU with set_thread_affinity.
+// The destructor runs all submitted tasks, including the tasks they submit, and joins the workers. Tasks must not throw and
+// must not be submitted from non-worker threads once the destructor has started.
+template<class Task = std::function<void()>, unsigned DEQUE_SIZE = 1024>
+class WorkStealingExecutor {
+    struct Node {
+        Task task;
+        Node* next;
+    };
+
+    struct alignas(CACHE_LINE_SIZE) Worker {
+        ChaseLevDeque<Node*, DEQUE_SIZE> deque;
+        WorkStealingExecutor* executor;
+        unsigned index;
+        uint32_t random;
+        // The nodes of the tasks this worker has run, to submit the next tasks without allocating. Only this worker uses them.
+        Node* free_nodes = nullptr;
+        unsigned free_count = 0;
+        std::thread thread;
+
+        Worker(WorkStealingExecutor* e, unsigned i) noexcept
+            : executor(e)
+            , index(i)
+            , random(i * 0x9e3779b9u + 1) {}
+
+        uint32_t next_random() noexcept { // xorshift32.
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            return random;
+        }
+    };
+
+    static constexpr unsigned SPIN_COUNT = 1024;
+
+    AtomicQueueB2<Task> injection_;
+    std::function<void(unsigned)> on_start_;
+    unsigned char* storage_;
+    Worker* workers_;
+    unsigned worker_count_;
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> stop_ = {false};
+
+    static Worker*& current() noexcept {
+        static thread_local Worker* worker = nullptr;
+        return worker;
+    }
+
+    Worker* current_worker() const noexcept {
+        Worker* w = current();
+        return w && w->executor == this ? w : nullptr;
+    }
+
+    template<class F>
+    static Node* new_node(Worker& w, F&& f) {
+        Node* node = w.free_nodes;
+        if(!node)
+            return new Node{Task(std::forward<F>(f)), nullptr};
+        w.free_nodes = node->next;
+        --w.free_count;
+        node->task = std::forward<F>(f);
+        return node;
+    }
+
+    static void free_node(Worker& w, Node* node) noexcept {
+        if(w.free_count < DEQUE_SIZE) {
+            node->task = Task{}; // Release the resources of the task now.
+            node->next = w.free_nodes;
+            w.free_nodes = node;
+            ++w.free_count;
+        }
+        else {
+            delete node;
+        }
+    }
+
+    static void run(Worker& w, Node* node) noexcept {
+        node->task();
+        free_node(w, node);
+    }
+
+    bool steal(Worker& w, Node*& node) noexcept {
+        unsigned const n = worker_count_;
+        unsigned const first = static_cast<unsigned>((static_cast<uint64_t>(w.next_random()) * n) >> 32);
+        for(unsigned i = 0; i < n; ++i) {
+            unsigned const victim = first + i < n ? first + i : first + i - n;
+            if(victim != w.index && workers_[victim].deque.steal(node))
+                return true;
+        }
+        return false;
+    }
+
+    void work(Worker& w) noexcept {
+        current() = &w;
+        if(on_start_)
+            on_start_(w.index);
+        Node* node;
+        Task task;
+        bool stopping = false;
+        for(unsigned idle = 0;;) {
+            if(w.deque.take(node)) {
+                run(w, node);
+                idle = 0;
+            }
+            else if(injection_.try_pop(task)) {
+                task();
+                task = Task{};
+                idle = 0;
+            }
+            else if(steal(w, node)) {
+                run(w, node);
+                idle = 0;
+            }
+            else if(stopping) { // A full round after stop_ has found no work.
+                break;
+            }
+            else if(!(stopping = stop_.load(A))) {
+                if(++idle < SPIN_COUNT)
+                    spin_loop_pause();
+                else
+                    std::this_thread::yield();
+            }
+        }
+        current() = nullptr;
+    }
+
+    void stop() noexcept {
+        stop_.store(true, R);
+        // Join all the workers before destroying any, because they steal from each other until they stop.
+        for(unsigned i = 0; i < worker_count_; ++i)
+            if(workers_[i].thread.joinable())
+                workers_[i].thread.join();
+        for(unsigned i = 0; i < worker_count_; ++i) {
+            for(Node* node = workers_[i].free_nodes; node;) {
+                Node* next = node->next;
+                delete node;
+                node = next;
+            }
+            workers_[i].~Worker();
+        }
+        ::operator delete(storage_);
+    }
+
+public:
+    explicit WorkStealingExecutor(unsigned worker_count = std::thread::hardware_concurrency(), unsigned injection_capacity = 65536,
+                                  std::function<void(unsigned)> on_start = {})
+        : injection_(injection_capacity)
+        , on_start_(std::move(on_start))
+        , worker_count_(0) {
+        if(!worker_count)
+            worker_count = 1;
+        // Allocated with operator new and aligned here, because C++14 new does not support over-aligned types.
+        storage_ = static_cast<unsigned char*>(::operator new(sizeof(Worker) * worker_count + alignof(Worker) - 1));
+        workers_ = reinterpret_cast<Worker*>(details::align_up(storage_, alignof(Worker)));
+        for(unsigned i = 0; i < worker_count; ++i)
+            new(&workers_[i]) Worker(this, i);
+        worker_count_ = worker_count;
+        try {
+            for(unsigned i = 0; i < worker_count; ++i)
+                workers_[i].thread = std::thread(&WorkStealingExecutor::work, this, std::ref(workers_[i]));
+        }
+        catch(...) {
+            stop();
+            throw;
+        }
+    }
+
+    WorkStealingExecutor(WorkStealingExecutor const&) = delete;
+    WorkStealingExecutor& operator=(WorkStealingExecutor const&) = delete;
+
+    ~WorkStealingExecutor() noexcept {
+        stop();
+    }
+
+    template<class F>
+    void submit(F&& f) {
+        if(Worker* w = current_worker()) {
+            Node* node = new_node(*w, std::forward<F>(f));
+            if(ATOMIC_QUEUE_LIKELY(w->deque.push(node)))
+                return;
+            if(!injection_.try_push(std::move(node->task)))
+                node->task();
+            free_node(*w, node);
+        }
+        else {
+            injection_.push(Task(std::forward<F>(f)));
+        }
+    }
+
+    unsigned worker_count() const noexcept {
+        return worker_count_;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace atomic_queue
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#endif // ATOMIC_QUEUE_WORK_STEALING_H_INCLUDED
@@ -0,0 +1,103 @@
+#ifndef NUMA_PLACEMENT_H
+#define NUMA_PLACEMENT_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace shm {
+
+// The raw system calls are used so that linking against libnuma is not required. These are the values of <numaif.h> and
+// <linux/mempolicy.h>, which define them as enumerators rather than macros.
+constexpr int numa_mpol_default = 0;
+constexpr int numa_mpol_bind = 2;
+constexpr int numa_mpol_interleave = 3;
+constexpr int numa_mpol_f_node = 1 << 0;
+constexpr int numa_mpol_f_addr = 1 << 1;
+constexpr int numa_mpol_f_mems_allowed = 1 << 2;
+constexpr int numa_mpol_mf_move = 1 << 1;
+
+// The policy is applied in AttachSHM(), so it places the pages of the segment when it is created and first touched there,
+// e.g. by the channel constructing its queue. The pages which another process has already touched stay where they are:
+// migrating the pages mapped by more than one process requires MPOL_MF_MOVE_ALL and CAP_SYS_NICE.
+enum NUMA_POLICY {
+    NUMA_POLICY_DEFAULT = 0, // Leave the placement to the kernel: the first process to touch a page places it.
+    NUMA_POLICY_NODE,        // Bind the segment to NUMAPlacement::node.
+    NUMA_POLICY_LOCAL,       // Bind the segment to the node of the CPU calling AttachSHM(). Create the segment from the consumer.
+    NUMA_POLICY_INTERLEAVE   // Interleave the pages of the segment across all nodes the process may allocate on.
+};
+
+// To place the segment on the consumer's node when the producer creates it, pass the consumer's node to the producer with
+// NUMA_POLICY_NODE. On machines with one NUMA node per socket, CpuTopologyInfo::socket_id of the consumer's hardware thread,
+// as reported by get_cpu_topology_info(), is that node.
+struct NUMAPlacement {
+    NUMA_POLICY policy = NUMA_POLICY_DEFAULT;
+    int node = -1;
+};
+
+// Large enough for 1024 nodes, which is the kernel maximum on x86-64.
+constexpr unsigned numa_max_nodes = 1024;
+constexpr unsigned numa_mask_words = numa_max_nodes / (8 * sizeof(unsigned long));
+
+inline int NUMACurrentNode() {
+    unsigned cpu, node;
+    if(syscall(SYS_getcpu, &cpu, &node, nullptr) == -1) {
+        throw std::runtime_error("getcpu failed: " + std::string(strerror(errno)));
+    }
+    return static_cast<int>(node);
+}
+
+// Returns the node the page at addr resides on, or -1 if the kernel does not support NUMA.
+inline int NUMANodeOf(void* addr) {
+    int node = -1;
+    if(syscall(SYS_get_mempolicy, &node, nullptr, 0ul, addr, numa_mpol_f_node | numa_mpol_f_addr) == -1) {
+        return -1;
+    }
+    return node;
+}
+
+// Applies the placement to [addr, addr + length) and returns the node bound to, or -1 for NUMA_POLICY_DEFAULT and
+// NUMA_POLICY_INTERLEAVE. mbind on a shared mapping sets the policy of the shared memory object itself, so it governs the
+// pages faulted in by every process that attaches it, afterwards. Pages already faulted in are migrated with MPOL_MF_MOVE only
+// when no other process maps them, so call it before the first touch of the segment.
+inline int BindNUMA(void* addr, size_t length, NUMAPlacement placement) {
+    unsigned long mask[numa_mask_words] = {};
+    int mode = numa_mpol_default;
+    int node = -1;
+    switch(placement.policy) {
+    case NUMA_POLICY_DEFAULT:
+        return -1;
+    case NUMA_POLICY_NODE:
+        node = placement.node;
+        break;
+    case NUMA_POLICY_LOCAL:
+        node = NUMACurrentNode();
+        break;
+    case NUMA_POLICY_INTERLEAVE:
+        if(syscall(SYS_get_mempolicy, nullptr, mask, numa_max_nodes, nullptr, numa_mpol_f_mems_allowed) == -1) {
+            throw std::runtime_error("get_mempolicy failed: " + std::string(strerror(errno)));
+        }
+        mode = numa_mpol_interleave;
+        break;
+    }
+    if(mode != numa_mpol_interleave) {
+        if(node < 0 || static_cast<unsigned>(node) >= numa_max_nodes) {
+            throw std::runtime_error("Invalid NUMA node " + std::to_string(node));
+        }
+        mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+        mode = numa_mpol_bind;
+    }
+    // The kernel expects maxnode to be one greater than the number of bits in the mask.
+    if(syscall(SYS_mbind, addr, length, mode, mask, numa_max_nodes + 1, numa_mpol_mf_move) == -1) {
+        throw std::runtime_error("mbind failed: " + std::string(strerror(errno)));
+    }
+    return node;
+}
+
+} // namespace shm
+
+#endif
@@ -23,7 +23,7 @@ enum POSIX_CHANNEL_OPS {
 template<typename T, unsigned CHANNEL_SIZE, unsigned NUM_OF_COND>
 class POSIXChannel {
 public:
-    POSIXChannel(std::string name, int op)
+    POSIXChannel(std::string name, int op, NUMAPlacement placement = {})
         : name_(name)
         , shm_queue_(nullptr)
     {
@@ -43,7 +43,7 @@ public:
             name_ = "/" + name_;
         }
 
-        shm_ = std::make_unique<shm::posix::POSIXSharedMemory<SHMQueue>>(name_, sizeof(SHMQueue));
+        shm_ = std::make_unique<shm::posix::POSIXSharedMemory<SHMQueue>>(name_, sizeof(SHMQueue), placement);
         shm_queue_ = shm_->AttachSHM();
 
         if(op & POSIX_CHANNEL_CREATE) {
@@ -51,9 +51,11 @@ public:
             new (shm_queue_) SHMQueue();
             init_mutexes();
         }
+        ATOMIC_QUEUE_PROBE3(shm_attach, name_.c_str(), shm_queue_, sizeof(SHMQueue));
     }
 
     ~POSIXChannel() {
+        ATOMIC_QUEUE_PROBE3(shm_detach, name_.c_str(), shm_queue_, sizeof(SHMQueue));
         shm_->DeattachSHM();
     }
 
@@ -67,6 +69,10 @@ public:
         return shm_queue_;
     }
 
+    int GetNUMANode() {
+        return shm_->GetNUMANode();
+    }
+
 private:
     bool file_exists(const std::string& filename) {
         return (access(filename.c_str(), F_OK) != -1);
@@ -2,6 +2,7 @@
 #define POSIX_SHM_AREA_H
 
 #include "shm/base_shm_area.h"
+#include "shm/numa_placement.h"
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -111,8 +112,8 @@ private:
 template<typename T>
 class POSIXSharedMemory final : public BaseSHMArea<T> {
 public:
-    POSIXSharedMemory(std::string name, size_t size_of_area)
-        : BaseSHMArea<T>(name, size_of_area), shm_fd_(-1), shm_addr_(nullptr) {
+    POSIXSharedMemory(std::string name, size_t size_of_area, NUMAPlacement placement = {})
+        : BaseSHMArea<T>(name, size_of_area), shm_fd_(-1), shm_addr_(nullptr), placement_(placement) {
         if(this->name_.front() != '/') {
             this->name_ = "/" + this->name_;
         }
@@ -130,6 +131,7 @@ public:
         if(shm_addr_ == MAP_FAILED) {
             throw std::runtime_error("mmap failed: " + std::string(strerror(errno)));
         }
+        BindNUMA(shm_addr_, this->size_of_shm_area_, placement_);
         return static_cast<std::remove_pointer_t<T>*>(shm_addr_);
     }
 
@@ -170,6 +172,11 @@ public:
         return std::make_shared<POSIXMutex>();
     }
 
+    // The node the first page of the area resides on, or -1 when not attached or NUMA is not supported.
+    int GetNUMANode() {
+        return shm_addr_ ? NUMANodeOf(shm_addr_) : -1;
+    }
+
     void RemoveSHM() {
         if(shm_unlink(this->name_.c_str()) == -1) {
             throw std::runtime_error("shm_unlink failed: " + std::string(strerror(errno)));
@@ -179,6 +186,7 @@ public:
 private:
     int shm_fd_;
     void* shm_addr_;
+    NUMAPlacement placement_;
 };
 
 } // namespace posix
@@ -17,7 +17,7 @@ template<typename T, unsigned CHANNEL_SIZE, unsigned NUM_OF_COND>
 class XSIChannel {
 public:
 
-    XSIChannel(std::string name, int op)
+    XSIChannel(std::string name, int op, NUMAPlacement placement = {})
         : name_(name)
         , shm_queue_(nullptr) {
         if(op & XSI_CHANNEL_CLEAN) {
@@ -34,7 +34,7 @@ public:
             create_files();
         }
 
-        shm_ = std::make_unique<XSISharedMemory<SHMQueue>>(name, sizeof(SHMQueue));
+        shm_ = std::make_unique<XSISharedMemory<SHMQueue>>(name, sizeof(SHMQueue), placement);
 
         shm_queue_ = shm_->AttachSHM();
 
@@ -43,9 +43,11 @@ public:
             new (shm_queue_) SHMQueue();
             init_mutexes();
         }
+        ATOMIC_QUEUE_PROBE3(shm_attach, name_.c_str(), shm_queue_, sizeof(SHMQueue));
     }
 
     ~XSIChannel() {
+        ATOMIC_QUEUE_PROBE3(shm_detach, name_.c_str(), shm_queue_, sizeof(SHMQueue));
         shm_->DeattachSHM();
     }
 
@@ -59,6 +61,10 @@ public:
         return shm_queue_;
     }
 
+    int GetNUMANode() {
+        return shm_->GetNUMANode();
+    }
+
 private:
     bool file_exists(const std::string& filename) {
         return (access(filename.c_str(), F_OK) != -1);
@@ -2,6 +2,7 @@
 #define XSI_SHM_AREA_H
 
 #include "shm/base_shm_area.h"
+#include "shm/numa_placement.h"
 #include <cerrno>
 #include <cstddef>
 #include <cstring>
@@ -126,10 +127,11 @@ private:
 template<typename T>
 class XSISharedMemory final : public shm::BaseSHMArea<T> {
 public:
-    XSISharedMemory(std::string name, size_t size_of_area)
+    XSISharedMemory(std::string name, size_t size_of_area, NUMAPlacement placement = {})
         : shm::BaseSHMArea<T>(name, size_of_area)
         , shmid_(-1)
-        , shm_addr_(nullptr) {
+        , shm_addr_(nullptr)
+        , placement_(placement) {
         mu_ = std::make_shared<XSIMutex>(this->name_ + mutex_prefix);
     }
 
@@ -146,6 +148,7 @@ public:
         if(shm_addr_ == reinterpret_cast<void*>(-1)) {
             throw std::runtime_error("[AttachSHM] shmat failed: " + std::string(strerror(errno)));
         }
+        BindNUMA(shm_addr_, this->size_of_shm_area_, placement_);
         return static_cast<std::remove_pointer_t<T>*>(shm_addr_);
     }
 
@@ -166,9 +169,15 @@ public:
         return mu_;
     }
 
+    // The node the first page of the segment resides on, or -1 when not attached or NUMA is not supported.
+    int GetNUMANode() {
+        return shm_addr_ ? NUMANodeOf(shm_addr_) : -1;
+    }
+
 private:
     int shmid_;
     void* shm_addr_;
+    NUMAPlacement placement_;
     std::shared_ptr<XSIMutex> mu_;
 };
 
@@ -0,0 +1,345 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */
+
+// Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
+
+// Measures the throughput and latency of the BestQueue candidates on this host and writes a header with the QueueTuning
+// specializations of the fastest ones. Usage:
+//
+//     autotune [--latency] [--messages=N] [<header>]
+//
+// <header> defaults to atomic_queue_tuned.h. --latency selects the SPSC queues by the ping-pong round-trip time instead of
+// throughput. Compile with -DATOMIC_QUEUE_TUNED_HEADER='"<header>"' for best_queue_t to use the tuned choices.
+
+#include "atomic_queue/barrier.h"
+#include "atomic_queue/best_queue.h"
+
+#include "cpu_base_frequency.h"
+#include "huge_pages.h"
+
+#include <algorithm>
+#include <chrono>
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+using namespace atomic_queue;
+
+using Clock = std::chrono::steady_clock;
+
+double to_seconds(Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+// A non-atomic element, as large as a pointer and length pair.
+struct Payload {
+    unsigned value;
+    unsigned pad[3];
+
+    Payload() noexcept = default;
+
+    Payload(unsigned v) noexcept
+        : value(v) {}
+
+    operator unsigned() const noexcept {
+        return value;
+    }
+};
+
+constexpr unsigned SIZE = 65536;
+constexpr unsigned PING_PONG_SIZE = 8; // See run_ping_pong_benchmarks in benchmarks.cc.
+constexpr int RUNS = 3;
+
+struct Options {
+    char const* header = "atomic_queue_tuned.h";
+    unsigned messages = 1000000;
+    bool latency = false;
+};
+
+struct Setup {
+    Options const& options;
+    HugePages& hp;
+    std::vector<unsigned> const& hw_thread_ids;
+    unsigned threads; // The number of producers and consumers each for MPMC.
+};
+
+struct Result {
+    QueueKind kind;
+    bool minimize_contention;
+    bool maximize_throughput;
+    double msg_per_sec;
+    double round_trip; // SPSC only.
+};
+
+char const* kind_name(QueueKind kind) {
+    switch(kind) {
+    case QueueKind::ATOMIC_QUEUE: return "ATOMIC_QUEUE";
+    case QueueKind::ATOMIC_QUEUE2: return "ATOMIC_QUEUE2";
+    case QueueKind::SPSC_ATOMIC_QUEUE: return "SPSC_ATOMIC_QUEUE";
+    }
+    return "";
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class Queue>
+void throughput_producer(Queue* queue, unsigned N, Barrier* barrier) {
+    barrier->wait();
+    for(unsigned n = 1; n <= N; ++n)
+        queue->push(n);
+}
+
+template<class Queue>
+void throughput_consumer(Queue* queue, unsigned N, Barrier* barrier, uint64_t* sum) {
+    barrier->wait();
+    uint64_t s = 0;
+    for(unsigned n = N; n--;)
+        s += static_cast<unsigned>(queue->pop());
+    *sum = s;
+}
+
+// Each of the producers pushes N messages and each of the same number of consumers pops N messages.
+template<class Queue>
+double benchmark_throughput(Setup const& ctx, unsigned threads) {
+    unsigned const N = ctx.options.messages / threads;
+    auto queue = ctx.hp.create_unique_ptr<Queue>();
+    Barrier barrier;
+    std::vector<uint64_t> sums(threads);
+    std::vector<std::thread> workers;
+    workers.reserve(threads * 2);
+    for(unsigned i = 0; i < threads; ++i) {
+        set_default_thread_affinity(ctx.hw_thread_ids[(2 * i) % ctx.hw_thread_ids.size()]);
+        workers.emplace_back(throughput_producer<Queue>, queue.get(), N, &barrier);
+        set_default_thread_affinity(ctx.hw_thread_ids[(2 * i + 1) % ctx.hw_thread_ids.size()]);
+        workers.emplace_back(throughput_consumer<Queue>, queue.get(), N, &barrier, &sums[i]);
+    }
+
+    barrier.release(threads * 2);
+    auto t0 = Clock::now();
+    for(auto& t : workers)
+        t.join();
+    auto t1 = Clock::now();
+
+    uint64_t total_sum = 0;
+    for(auto sum : sums)
+        total_sum += sum;
+    if(total_sum != (uint64_t{N} + 1) * N / 2 * threads)
+        throw std::runtime_error("autotune: wrong throughput checksum.");
+
+    return N * threads / to_seconds(t1 - t0);
+}
+
+template<class Queue>
+void ping_pong_receiver(Queue* q1, Queue* q2, unsigned N, Barrier* barrier) {
+    barrier->wait();
+    for(unsigned n = N; n--;)
+        q2->push(q1->pop());
+}
+
+// The round-trip time of a message sent to the receiver and back.
+template<class Queue>
+double benchmark_round_trip(Setup const& ctx) {
+    unsigned const N = ctx.options.messages / 10;
+    auto q1 = ctx.hp.create_unique_ptr<Queue>();
+    auto q2 = ctx.hp.create_unique_ptr<Queue>();
+    Barrier barrier;
+    set_thread_affinity(ctx.hw_thread_ids[0]); // This thread is the sender.
+    set_default_thread_affinity(ctx.hw_thread_ids[1 % ctx.hw_thread_ids.size()]);
+    std::thread receiver(ping_pong_receiver<Queue>, q1.get(), q2.get(), N, &barrier);
+    barrier.release(1);
+
+    auto t0 = Clock::now();
+    bool ok = true;
+    for(unsigned n = 1; n <= N; ++n) {
+        q1->push(n);
+        ok &= static_cast<unsigned>(q2->pop()) == n;
+    }
+    auto t1 = Clock::now();
+
+    receiver.join();
+    reset_thread_affinity();
+    if(!ok)
+        throw std::runtime_error("autotune: wrong ping-pong message.");
+    return to_seconds(t1 - t0) / N;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The messages are never T{}, which is the NIL value of the AtomicQueue candidates.
+template<class T>
+struct ZeroNil {
+    static constexpr T value = T{};
+};
+
+template<class T, bool SPSC, QueueKind KIND, bool MINIMIZE_CONTENTION, bool MAXIMIZE_THROUGHPUT>
+void measure(Setup const& ctx, std::vector<Result>& results) {
+    using Queue = typename details::QueueOfKind<KIND, T, SIZE, SPSC, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, ZeroNil<T>>::type;
+    using PingPongQueue = typename details::QueueOfKind<KIND, T, PING_PONG_SIZE, SPSC, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, ZeroNil<T>>::type;
+
+    Result r{KIND, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, 0, 0};
+    for(int run = RUNS; run--;) {
+        r.msg_per_sec = std::max(r.msg_per_sec, benchmark_throughput<Queue>(ctx, SPSC ? 1 : ctx.threads));
+        if(SPSC) {
+            double round_trip = benchmark_round_trip<PingPongQueue>(ctx);
+            r.round_trip = run == RUNS - 1 ? round_trip : std::min(r.round_trip, round_trip);
+        }
+    }
+
+    std::printf("%20s, MINIMIZE_CONTENTION=%d, MAXIMIZE_THROUGHPUT=%d: %'13.0f msg/sec", kind_name(KIND), MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT,
+                r.msg_per_sec);
+    if(SPSC)
+        std::printf(", %.9f sec/round-trip", r.round_trip);
+    std::printf("\n");
+    results.push_back(r);
+}
+
+template<class T, bool SPSC, QueueKind KIND>
+void measure_flags(Setup const& ctx, std::vector<Result>& results) {
+    measure<T, SPSC, KIND, false, false>(ctx, results);
+    measure<T, SPSC, KIND, false, true>(ctx, results);
+    measure<T, SPSC, KIND, true, false>(ctx, results);
+    measure<T, SPSC, KIND, true, true>(ctx, results);
+}
+
+template<class T, bool SPSC>
+void measure_atomic_queue(Setup const&, std::vector<Result>&, std::false_type) {}
+
+template<class T, bool SPSC>
+void measure_atomic_queue(Setup const& ctx, std::vector<Result>& results, std::true_type) {
+    measure_flags<T, SPSC, QueueKind::ATOMIC_QUEUE>(ctx, results);
+}
+
+template<class T>
+void measure_spsc_queue(Setup const&, std::vector<Result>&, std::false_type) {}
+
+template<class T>
+void measure_spsc_queue(Setup const& ctx, std::vector<Result>& results, std::true_type) {
+    measure<T, true, QueueKind::SPSC_ATOMIC_QUEUE, false, false>(ctx, results); // SpscAtomicQueue has no such flags.
+}
+
+// Returns the QueueTuning specialization of the best candidate.
+template<class T, bool SPSC>
+std::string tune(Setup const& ctx, char const* name) {
+    bool constexpr atomic_elements = details::IsAtomicElement<T>::value;
+    if(SPSC)
+        std::printf("---- %s, 1 producer, 1 consumer ----\n", name);
+    else
+        std::printf("---- %s, %u producers, %u consumers ----\n", name, ctx.threads, ctx.threads);
+
+    std::vector<Result> results;
+    measure_atomic_queue<T, SPSC>(ctx, results, std::integral_constant<bool, atomic_elements>{});
+    measure_flags<T, SPSC, QueueKind::ATOMIC_QUEUE2>(ctx, results);
+    measure_spsc_queue<T>(ctx, results, std::integral_constant<bool, SPSC>{});
+
+    bool const by_latency = SPSC && ctx.options.latency;
+    auto best = std::min_element(results.begin(), results.end(), [by_latency](Result const& a, Result const& b) {
+        return by_latency ? a.round_trip < b.round_trip : a.msg_per_sec > b.msg_per_sec;
+    });
+
+    char buf[512];
+    int n = std::snprintf(buf, sizeof buf, "template<> struct QueueTuning<%s, %s> : QueueTuned<QueueKind::%s, %s, %s> {}; // %s: %.0f msg/sec",
+                          SPSC ? "true" : "false", atomic_elements ? "true" : "false", kind_name(best->kind), best->minimize_contention ? "true" : "false",
+                          best->maximize_throughput ? "true" : "false", name, best->msg_per_sec);
+    if(SPSC)
+        std::snprintf(buf + n, sizeof buf - n, ", %.9f sec/round-trip", best->round_trip);
+    std::printf("best: %s\n\n", buf);
+    return buf;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::string cpu_model_name() {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    for(std::string line; getline(cpuinfo, line);)
+        if(!line.compare(0, 10, "model name")) {
+            auto pos = line.find(':');
+            return pos == std::string::npos ? line : line.substr(line.find_first_not_of(" \t", pos + 1));
+        }
+    return "unknown CPU";
+}
+
+void write_header(Options const& options, std::vector<std::string> const& specializations, unsigned hw_threads) {
+    char host[256] = {};
+    ::gethostname(host, sizeof host - 1);
+    char date[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof date, "%Y-%m-%d", std::localtime(&now));
+
+    std::ofstream out(options.header);
+    out << "/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 4 -*- */\n"
+        << "#ifndef ATOMIC_QUEUE_TUNED_H_INCLUDED\n"
+        << "#define ATOMIC_QUEUE_TUNED_H_INCLUDED\n\n"
+        << "// Generated by autotune on " << host << ", " << cpu_model_name() << ", " << hw_threads << " hardware threads, " << date << ".\n"
+        << "// Include with -DATOMIC_QUEUE_TUNED_HEADER='\"" << options.header << "\"', see atomic_queue/best_queue.h.\n\n"
+        << "namespace atomic_queue {\n\n";
+    for(auto& s : specializations)
+        out << s << '\n';
+    out << "\n} // namespace atomic_queue\n\n"
+        << "#endif // ATOMIC_QUEUE_TUNED_H_INCLUDED\n";
+    if(!out.flush())
+        throw std::runtime_error(std::string("autotune: failed to write ") + options.header);
+}
+
+Options parse_options(int ac, char** av) {
+    Options options;
+    for(int i = 1; i < ac; ++i) {
+        if(!std::strcmp(av[i], "--latency"))
+            options.latency = true;
+        else if(!std::strncmp(av[i], "--messages=", 11))
+            options.messages = std::max(std::strtoul(av[i] + 11, nullptr, 10), 10ul);
+        else if(av[i][0] != '-')
+            options.header = av[i];
+        else
+            throw std::runtime_error(std::string("autotune: unknown option ") + av[i] + ". Usage: autotune [--latency] [--messages=N] [<header>]");
+    }
+    return options;
+}
+
+void advise_hugeadm_2MB() {
+    std::fprintf(stderr, "Warning: Failed to allocate 2MB huge pages. Run \"sudo hugeadm --pool-pages-min 2MB:16 --pool-pages-max 2MB:16\".\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int main(int ac, char** av) {
+    std::setlocale(LC_NUMERIC, ""); // Enable thousand separator, if set in user's locale.
+
+    Options const options = parse_options(ac, av);
+
+    auto hw_thread_ids = hw_thread_id(get_cpu_topology_info()); // Sorted by hw_thread_id: avoid HT, same socket.
+    unsigned const hw_threads = hw_thread_ids.size();
+    if(hw_threads < 4)
+        std::fprintf(stderr, "Warning: %u hardware threads, the producers and consumers share CPUs and the results are not representative.\n", hw_threads);
+
+    HugePages::warn_no_2MB_pages = advise_hugeadm_2MB;
+    size_t constexpr MB = 1024 * 1024;
+    HugePages hp(HugePages::PAGE_2MB, 16 * MB);
+
+    Setup const ctx{options, hp, hw_thread_ids, std::max(hw_threads / 2, 2u)};
+    std::vector<std::string> specializations{
+        tune<unsigned, true>(ctx, "SPSC, atomic elements"),
+        tune<Payload, true>(ctx, "SPSC, non-atomic elements"),
+        tune<unsigned, false>(ctx, "MPMC, atomic elements"),
+        tune<Payload, false>(ctx, "MPMC, non-atomic elements"),
+    };
+    write_header(options, specializations, hw_threads);
+    std::printf("Wrote %s.\n", options.header);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -3,8 +3,13 @@
 // Copyright (c) 2019 Maxim Egorushkin. MIT License. See the full licence in file LICENSE.
 
 #include "atomic_queue/atomic_queue.h"
+#include "atomic_queue/atomic_queue16.h"
 #include "atomic_queue/atomic_queue_mutex.h"
 #include "atomic_queue/barrier.h"
+#include "atomic_queue/residence_time.h"
+#include "atomic_queue/spsc_queue.h"
+#include "atomic_queue/unbounded_queue.h"
+#include "atomic_queue/work_stealing.h"
 
 #include <xenium/michael_scott_queue.hpp>
 #include <xenium/ramalhete_queue.hpp>
@@ -26,6 +31,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <functional>
 #include <limits>
 #include <stdexcept>
 #include <thread>
@@ -129,12 +135,65 @@ struct TbbAdapter : RetryDecorator<Queue> {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Flushes the queue when the producer is done, for queues which publish their elements in batches.
+template<class Queue>
+struct FlushOnProducerExit : Queue {
+    struct Producer : NoToken {
+        Queue& queue;
+
+        Producer(Queue& q) noexcept
+            : queue(q) {}
+
+        ~Producer() noexcept {
+            queue.flush();
+        }
+    };
+};
+
+// Pushes through atomic_queue::ProducerToken, which claims the indices for BLOCK elements with one atomic operation. The
+// consumers pop as usual: a ConsumerToken of a consumer which pops the stop message would push back its unpopped elements.
+template<class Queue, unsigned BLOCK = 16>
+struct ProducerTokenDecorator : Queue {
+    struct Producer : NoToken {
+        atomic_queue::ProducerToken<Queue, BLOCK> token;
+
+        Producer(Queue& q) noexcept
+            : token(q) {}
+
+        template<class T>
+        void push(Queue&, T&& element) noexcept {
+            token.push(std::forward<T>(element));
+        }
+    };
+};
+
 template<class Queue, size_t Capacity>
 struct CapacityToConstructor : Queue {
     CapacityToConstructor()
         : Queue(Capacity) {}
 };
 
+// The exact capacity without rounding up to a power of 2, see atomic_queue::arbitrary_capacity.
+template<class Queue, size_t Capacity>
+struct ArbitraryCapacityToConstructor : Queue {
+    ArbitraryCapacityToConstructor()
+        : Queue(atomic_queue::arbitrary_capacity, Capacity) {}
+};
+
+// Pops from atomic_queue::ResidenceTimeQueue into a histogram per consumer.
+template<class Queue>
+struct ResidenceTimeDecorator : atomic_queue::ResidenceTimeQueue<Queue> {
+    struct Consumer : NoToken {
+        atomic_queue::ResidenceHistogram histogram;
+
+        Consumer(ResidenceTimeDecorator&) noexcept {}
+
+        auto pop(ResidenceTimeDecorator& q) noexcept {
+            return q.pop(histogram);
+        }
+    };
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 using Allocator = HugePageAllocator<unsigned>;
@@ -168,6 +227,46 @@ struct QueueTypes {
     using OptimistAtomicQueue2 =                                Type<atomic_queue::AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, false, SPSC>>;
     using AtomicQueueB2 = Type<RetryDecorator<CapacityToConstructor<atomic_queue::AtomicQueueB2<T, Allocator, MAXIMIZE_THROUGHPUT, false, SPSC>, SIZE>>>;
     using OptimistAtomicQueueB2 =        Type<CapacityToConstructor<atomic_queue::AtomicQueueB2<T, Allocator, MAXIMIZE_THROUGHPUT, false, SPSC>, SIZE>>;
+
+    // The index mapped with a multiply-shift rather than a binary and, 3/4 of the memory of the above.
+    using OptimistAtomicQueueB3_4 =                 Type<ArbitraryCapacityToConstructor<atomic_queue::AtomicQueueB<T, Allocator, T{}, MAXIMIZE_THROUGHPUT, false, SPSC>, SIZE / 4 * 3>>;
+    using OptimistAtomicQueueB2_3_4 =      Type<ArbitraryCapacityToConstructor<atomic_queue::AtomicQueueB2<T, Allocator, MAXIMIZE_THROUGHPUT, false, SPSC>, SIZE / 4 * 3>>;
+
+    // 64-bit indexes, for the cost of the wider atomic operations on head_ and tail_.
+    using OptimistAtomicQueueB64 =
+        Type<CapacityToConstructor<atomic_queue::AtomicQueueB<T, Allocator, T{}, MAXIMIZE_THROUGHPUT, false, SPSC, atomic_queue::SpinWait, uint64_t>, SIZE>>;
+    using OptimistAtomicQueueB2_64 = Type<CapacityToConstructor<
+        atomic_queue::AtomicQueueB2<T, Allocator, MAXIMIZE_THROUGHPUT, false, SPSC, atomic_queue::SlotLayout::SEPARATE, atomic_queue::SpinWait, uint64_t>, SIZE>>;
+
+    // Non-atomic elements pushed through producer tokens.
+    using OptimistAtomicQueue2Tokens =              Type<ProducerTokenDecorator<atomic_queue::AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, false, SPSC>>>;
+    using OptimistAtomicQueueB2Tokens = Type<ProducerTokenDecorator<CapacityToConstructor<atomic_queue::AtomicQueueB2<T, Allocator, MAXIMIZE_THROUGHPUT, false, SPSC>, SIZE>>>;
+
+    // Non-atomic elements with a wait strategy other than SpinWait.
+    template<class WAIT>
+    using OptimistAtomicQueue2Wait = Type<atomic_queue::AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, false, SPSC, atomic_queue::SlotLayout::SEPARATE, WAIT>>;
+
+    // Non-atomic elements with the contention counters, separate for try_push/try_pop and push/pop.
+    template<bool OPTIMIST>
+    struct StatsTag {};
+    template<bool OPTIMIST>
+    using Stats = atomic_queue::CountingStats<StatsTag<OPTIMIST>>;
+    using AtomicQueue2Stats =
+        Type<RetryDecorator<atomic_queue::AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, false, SPSC, atomic_queue::SlotLayout::SEPARATE, atomic_queue::SpinWait, Stats<false>>>>;
+    using OptimistAtomicQueue2Stats =
+        Type<atomic_queue::AtomicQueue2<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT, false, SPSC, atomic_queue::SlotLayout::SEPARATE, atomic_queue::SpinWait, Stats<true>>>;
+
+    // Non-atomic elements with sequence numbered slots.
+    using SeqAtomicQueue =                     Type<RetryDecorator<atomic_queue::SeqAtomicQueue<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT>>>;
+    using OptimistSeqAtomicQueue =                            Type<atomic_queue::SeqAtomicQueue<T, SIZE, MINIMIZE_CONTENTION, MAXIMIZE_THROUGHPUT>>;
+
+    // Unbounded, SIZE is the segment size.
+    using UnboundedQueue =                     Type<RetryDecorator<atomic_queue::UnboundedQueue<T, SIZE>>>;
+    using OptimistUnboundedQueue =                            Type<atomic_queue::UnboundedQueue<T, SIZE>>;
+
+    // SPSC only.
+    using SpscAtomicQueue =                                   Type<atomic_queue::SpscAtomicQueue<T, SIZE>>;
+    using SpscAtomicQueueBatch16 =         Type<FlushOnProducerExit<atomic_queue::SpscAtomicQueue<T, SIZE, 16>>>;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -305,6 +404,12 @@ void run_throughput_benchmark(char const* name, HugePages& hp, std::vector<unsig
 
 constexpr int N_TROUGHPUT_MESSAGES = 1000000;
 
+// The contention counters of all the runs of a queue.
+void print_queue_stats(char const* name, QueueStats const& s) {
+    std::printf("%32s: %'llu CAS failures, %'llu spins, %'llu full, %'llu empty\n", name, static_cast<unsigned long long>(s.cas_failures),
+                static_cast<unsigned long long>(s.spins), static_cast<unsigned long long>(s.full), static_cast<unsigned long long>(s.empty));
+}
+
 template<class Queue>
 void run_throughput_mpmc_benchmark(char const* name, HugePages& hp, std::vector<unsigned> const& hw_thread_ids, Type<Queue>, unsigned thread_count_min = 1) {
     unsigned const thread_count_max = hw_thread_ids.size() / 2;
@@ -383,6 +488,51 @@ void run_throughput_benchmarks(HugePages& hp, std::vector<CpuTopologyInfo> const
     run_throughput_spsc_benchmark("OptimistAtomicQueueB2", hp, hw_thread_ids, SPSC::OptimistAtomicQueueB2{});
     run_throughput_mpmc_benchmark("OptimistAtomicQueueB2", hp, hw_thread_ids, MPMC::OptimistAtomicQueueB2{}, 2);
 
+    run_throughput_spsc_benchmark("OptimistAtomicQueueB<3/4>", hp, hw_thread_ids, SPSC::OptimistAtomicQueueB3_4{});
+    run_throughput_mpmc_benchmark("OptimistAtomicQueueB<3/4>", hp, hw_thread_ids, MPMC::OptimistAtomicQueueB3_4{}, 2);
+
+    run_throughput_spsc_benchmark("OptimistAtomicQueueB2<3/4>", hp, hw_thread_ids, SPSC::OptimistAtomicQueueB2_3_4{});
+    run_throughput_mpmc_benchmark("OptimistAtomicQueueB2<3/4>", hp, hw_thread_ids, MPMC::OptimistAtomicQueueB2_3_4{}, 2);
+
+    run_throughput_spsc_benchmark("OptimistAtomicQueueB<64>", hp, hw_thread_ids, SPSC::OptimistAtomicQueueB64{});
+    run_throughput_mpmc_benchmark("OptimistAtomicQueueB<64>", hp, hw_thread_ids, MPMC::OptimistAtomicQueueB64{}, 2);
+
+    run_throughput_spsc_benchmark("OptimistAtomicQueueB2<64>", hp, hw_thread_ids, SPSC::OptimistAtomicQueueB2_64{});
+    run_throughput_mpmc_benchmark("OptimistAtomicQueueB2<64>", hp, hw_thread_ids, MPMC::OptimistAtomicQueueB2_64{}, 2);
+
+    run_throughput_mpmc_benchmark("OptimistAtomicQueue2<Tokens>", hp, hw_thread_ids, MPMC::OptimistAtomicQueue2Tokens{}, 2);
+    run_throughput_mpmc_benchmark("OptimistAtomicQueueB2<Tokens>", hp, hw_thread_ids, MPMC::OptimistAtomicQueueB2Tokens{}, 2);
+
+    run_throughput_spsc_benchmark("AtomicQueue2<CountingStats>", hp, hw_thread_ids, SPSC::AtomicQueue2Stats{});
+    print_queue_stats("AtomicQueue2<CountingStats>", SPSC::Stats<false>::get());
+    run_throughput_mpmc_benchmark("AtomicQueue2<CountingStats>", hp, hw_thread_ids, MPMC::AtomicQueue2Stats{}, 2);
+    print_queue_stats("AtomicQueue2<CountingStats>", MPMC::Stats<false>::get());
+    run_throughput_spsc_benchmark("OptimistAtomicQueue2<CountingStats>", hp, hw_thread_ids, SPSC::OptimistAtomicQueue2Stats{});
+    print_queue_stats("OptimistAtomicQueue2<CountingStats>", SPSC::Stats<true>::get());
+    run_throughput_mpmc_benchmark("OptimistAtomicQueue2<CountingStats>", hp, hw_thread_ids, MPMC::OptimistAtomicQueue2Stats{}, 2);
+    print_queue_stats("OptimistAtomicQueue2<CountingStats>", MPMC::Stats<true>::get());
+
+    run_throughput_spsc_benchmark("SeqAtomicQueue", hp, hw_thread_ids, SPSC::SeqAtomicQueue{});
+    run_throughput_mpmc_benchmark("SeqAtomicQueue", hp, hw_thread_ids, MPMC::SeqAtomicQueue{}, 2);
+
+    run_throughput_spsc_benchmark("OptimistSeqAtomicQueue", hp, hw_thread_ids, SPSC::OptimistSeqAtomicQueue{});
+    run_throughput_mpmc_benchmark("OptimistSeqAtomicQueue", hp, hw_thread_ids, MPMC::OptimistSeqAtomicQueue{}, 2);
+
+    run_throughput_spsc_benchmark("UnboundedQueue", hp, hw_thread_ids, SPSC::UnboundedQueue{});
+    run_throughput_mpmc_benchmark("UnboundedQueue", hp, hw_thread_ids, MPMC::UnboundedQueue{}, 2);
+
+    run_throughput_spsc_benchmark("OptimistUnboundedQueue", hp, hw_thread_ids, SPSC::OptimistUnboundedQueue{});
+    run_throughput_mpmc_benchmark("OptimistUnboundedQueue", hp, hw_thread_ids, MPMC::OptimistUnboundedQueue{}, 2);
+
+    // Wait strategies trade the latency for the CPU time burned while waiting.
+    run_throughput_mpmc_benchmark("OptimistAtomicQueue2<SpinYield>", hp, hw_thread_ids, MPMC::OptimistAtomicQueue2Wait<atomic_queue::SpinYieldWait<>>{}, 2);
+    run_throughput_mpmc_benchmark("OptimistAtomicQueue2<Backoff>", hp, hw_thread_ids, MPMC::OptimistAtomicQueue2Wait<atomic_queue::BackoffWait<>>{}, 2);
+    run_throughput_mpmc_benchmark("OptimistAtomicQueue2<Umwait>", hp, hw_thread_ids, MPMC::OptimistAtomicQueue2Wait<atomic_queue::UmwaitWait<>>{}, 2);
+    run_throughput_mpmc_benchmark("OptimistAtomicQueue2<AtomicWait>", hp, hw_thread_ids, MPMC::OptimistAtomicQueue2Wait<atomic_queue::AtomicWait<>>{}, 2);
+
+    run_throughput_spsc_benchmark("SpscAtomicQueue", hp, hw_thread_ids, SPSC::SpscAtomicQueue{});
+    run_throughput_spsc_benchmark("SpscAtomicQueue<16>", hp, hw_thread_ids, SPSC::SpscAtomicQueueBatch16{});
+
     // run_throughput_mpmc_benchmark<RetryDecorator<AtomicQueueSpinlockHle<unsigned, SIZE>>>("SpinlockHle");
 
     std::printf("\n");
@@ -390,6 +540,235 @@ void run_throughput_benchmarks(HugePages& hp, std::vector<CpuTopologyInfo> const
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// A queue element of BYTES bytes, which converts to and from the message number.
+template<unsigned BYTES>
+struct Payload {
+    unsigned value;
+    unsigned char padding[BYTES - sizeof(unsigned)];
+
+    Payload() noexcept = default;
+
+    Payload(unsigned v) noexcept
+        : value(v) {}
+
+    operator unsigned() const noexcept {
+        return value;
+    }
+};
+
+template<class T, SlotLayout LAYOUT>
+void run_slot_layout_benchmark(char const* layout, HugePages& hp, std::vector<unsigned> const& hw_thread_ids) {
+    constexpr unsigned SIZE = 65536;
+    char name[64];
+    // The same parameters as QueueTypes SPSC and MPMC in run_throughput_benchmarks.
+    std::snprintf(name, sizeof name, "AtomicQueue2<%zu,%s>", sizeof(T), layout);
+    run_throughput_spsc_benchmark(name, hp, hw_thread_ids, Type<RetryDecorator<AtomicQueue2<T, SIZE, false, false, false, true, LAYOUT>>>{});
+    run_throughput_mpmc_benchmark(name, hp, hw_thread_ids, Type<RetryDecorator<AtomicQueue2<T, SIZE, true, true, false, false, LAYOUT>>>{}, 2);
+    std::snprintf(name, sizeof name, "OptimistAtomicQueue2<%zu,%s>", sizeof(T), layout);
+    run_throughput_spsc_benchmark(name, hp, hw_thread_ids, Type<AtomicQueue2<T, SIZE, false, false, false, true, LAYOUT>>{});
+    run_throughput_mpmc_benchmark(name, hp, hw_thread_ids, Type<AtomicQueue2<T, SIZE, true, true, false, false, LAYOUT>>{}, 2);
+}
+
+template<class T>
+void run_slot_layout_benchmarks(HugePages& hp, std::vector<unsigned> const& hw_thread_ids) {
+    run_slot_layout_benchmark<T, SlotLayout::SEPARATE>("separate", hp, hw_thread_ids);
+    run_slot_layout_benchmark<T, SlotLayout::INTERLEAVED>("interleaved", hp, hw_thread_ids);
+    run_slot_layout_benchmark<T, SlotLayout::PADDED>("padded", hp, hw_thread_ids);
+}
+
+// Sweeps the slot layouts of AtomicQueue2 over element sizes, and compares AtomicQueue16 for 16-byte elements.
+void run_slot_layout_benchmarks(HugePages& hp, std::vector<CpuTopologyInfo> const& cpu_topology) {
+    auto hw_thread_ids = hw_thread_id(cpu_topology); // Sorted by hw_thread_id: avoid HT, same socket.
+
+    std::printf("---- Running slot layout throughput benchmarks (higher is better) ----\n");
+
+    run_slot_layout_benchmarks<unsigned>(hp, hw_thread_ids);
+    run_slot_layout_benchmarks<Payload<16>>(hp, hw_thread_ids);
+
+    // 16-byte elements in one array of slots updated with a double-width CAS.
+    using P16 = Payload<16>;
+    constexpr unsigned SIZE = 65536;
+    run_throughput_spsc_benchmark("AtomicQueue16", hp, hw_thread_ids, Type<RetryDecorator<AtomicQueue16<P16, SIZE, false, false, false, true>>>{});
+    run_throughput_mpmc_benchmark("AtomicQueue16", hp, hw_thread_ids, Type<RetryDecorator<AtomicQueue16<P16, SIZE, true, true, false, false>>>{}, 2);
+    run_throughput_spsc_benchmark("OptimistAtomicQueue16", hp, hw_thread_ids, Type<AtomicQueue16<P16, SIZE, false, false, false, true>>{});
+    run_throughput_mpmc_benchmark("OptimistAtomicQueue16", hp, hw_thread_ids, Type<AtomicQueue16<P16, SIZE, true, true, false, false>>{}, 2);
+
+    run_slot_layout_benchmarks<Payload<48>>(hp, hw_thread_ids);
+
+    std::printf("\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class Queue>
+void residence_time_producer(unsigned N, Queue* queue, Barrier* barrier) {
+    barrier->wait();
+    for(unsigned n = 1; n <= N; ++n)
+        queue->push(n);
+}
+
+template<class Queue>
+void residence_time_consumer(unsigned N, Queue* queue, ResidenceHistogram* histogram, Barrier* barrier) {
+    barrier->wait();
+    for(unsigned n = N; n--;)
+        queue->pop(*histogram);
+}
+
+// The percentiles of the time the elements spend in the queue while the producers push as fast as they can.
+template<class Queue>
+void run_residence_time_benchmark(char const* name, HugePages& hp, std::vector<unsigned> const& hw_thread_ids, unsigned thread_count) {
+    unsigned const N = N_TROUGHPUT_MESSAGES / thread_count;
+    auto queue = hp.create_unique_ptr<Queue>(ContextOf<Queue>{thread_count, thread_count});
+    std::vector<ResidenceHistogram> histograms(thread_count);
+    Barrier barrier;
+    std::vector<std::thread> threads(thread_count * 2);
+    unsigned cpu_idx = 0;
+    for(unsigned i = 0; i < thread_count; ++i) {
+        set_default_thread_affinity(hw_thread_ids[cpu_idx++]);
+        threads[i] = std::thread(residence_time_producer<Queue>, N, queue.get(), &barrier);
+    }
+    for(unsigned i = 0; i < thread_count; ++i) {
+        set_default_thread_affinity(hw_thread_ids[cpu_idx++]);
+        threads[thread_count + i] = std::thread(residence_time_consumer<Queue>, N, queue.get(), &histograms[i], &barrier);
+    }
+    barrier.release(thread_count * 2);
+    for(auto& t : threads)
+        t.join();
+    queue.reset();
+    check_huge_pages_leaks(name, hp);
+
+    ResidenceHistogram total;
+    for(auto& histogram : histograms)
+        total.add(histogram);
+    std::printf("%32s,%2u: p50 %.9f, p99 %.9f, p99.9 %.9f sec/residence\n", name, thread_count, to_seconds(total.percentile(.5)),
+                to_seconds(total.percentile(.99)), to_seconds(total.percentile(.999)));
+}
+
+// The throughput with and without the time stamps and the time the elements spend in the queue.
+void run_residence_time_benchmarks(HugePages& hp, std::vector<CpuTopologyInfo> const& cpu_topology) {
+    auto hw_thread_ids = hw_thread_id(cpu_topology); // Sorted by hw_thread_id: avoid HT, same socket.
+
+    std::printf("---- Running residence time benchmarks ----\n");
+
+    constexpr unsigned SIZE = 65536;
+    // The same parameters as QueueTypes SPSC and MPMC in run_throughput_benchmarks.
+    using SpscStamped = ResidenceTimeDecorator<AtomicQueue2<TscStamped<unsigned>, SIZE, false, false, false, true>>;
+    using MpmcStamped = ResidenceTimeDecorator<AtomicQueue2<TscStamped<unsigned>, SIZE, true, true, false, false>>;
+    run_throughput_spsc_benchmark("OptimistAtomicQueue2", hp, hw_thread_ids, Type<ResidenceTimeDecorator<AtomicQueue2<unsigned, SIZE, false, false, false, true>>>{});
+    run_throughput_spsc_benchmark("OptimistAtomicQueue2<TscStamped>", hp, hw_thread_ids, Type<SpscStamped>{});
+    run_throughput_mpmc_benchmark("OptimistAtomicQueue2", hp, hw_thread_ids, Type<ResidenceTimeDecorator<AtomicQueue2<unsigned, SIZE, true, true, false, false>>>{}, 2);
+    run_throughput_mpmc_benchmark("OptimistAtomicQueue2<TscStamped>", hp, hw_thread_ids, Type<MpmcStamped>{}, 2);
+
+    run_residence_time_benchmark<SpscStamped>("OptimistAtomicQueue2<TscStamped>", hp, hw_thread_ids, 1);
+    for(unsigned threads = 2, thread_count_max = hw_thread_ids.size() / 2; threads <= thread_count_max; ++threads)
+        run_residence_time_benchmark<MpmcStamped>("OptimistAtomicQueue2<TscStamped>", hp, hw_thread_ids, threads);
+
+    std::printf("\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The thread pool of one shared AtomicQueueB2 of tasks, to compare WorkStealingExecutor with. A task submitted while the queue
+// is full runs in place.
+class SingleQueuePool {
+    using Task = std::function<void()>;
+
+    AtomicQueueB2<Task> queue_;
+    std::function<void(unsigned)> on_start_;
+    std::vector<std::thread> threads_;
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> stop_{false};
+
+    void work(unsigned index) {
+        on_start_(index);
+        Task task;
+        bool stopping = false;
+        for(unsigned idle = 0;;) {
+            if(queue_.try_pop(task)) {
+                task();
+                idle = 0;
+            }
+            else if(stopping) {
+                break;
+            }
+            else if(!(stopping = stop_.load(A))) {
+                if(++idle < 1024)
+                    spin_loop_pause();
+                else
+                    std::this_thread::yield();
+            }
+        }
+    }
+
+public:
+    SingleQueuePool(unsigned worker_count, unsigned capacity, std::function<void(unsigned)> on_start)
+        : queue_(capacity)
+        , on_start_(std::move(on_start)) {
+        for(unsigned i = 0; i < worker_count; ++i)
+            threads_.emplace_back(&SingleQueuePool::work, this, i);
+    }
+
+    ~SingleQueuePool() noexcept {
+        stop_.store(true, R);
+        for(auto& t : threads_)
+            t.join();
+    }
+
+    template<class F>
+    void submit(F&& f) {
+        Task task(std::forward<F>(f));
+        if(!queue_.try_push(std::move(task)))
+            task();
+    }
+};
+
+template<class Executor>
+void fork_tree(Executor& executor, unsigned depth) {
+    if(depth)
+        for(int i = 2; i--;)
+            executor.submit([&executor, depth]() { fork_tree(executor, depth - 1); });
+}
+
+// The time to run a binary tree of tasks, where each task submits its 2 children from a worker thread. The destructor of the
+// executor returns after the last task. The queue capacity fits all the tasks, so that none runs in place.
+template<class Executor>
+cycles_t benchmark_executor(std::vector<unsigned> const& hw_thread_ids, unsigned worker_count, unsigned depth) {
+    cycles_t t0;
+    {
+        Executor executor(worker_count, 2u << depth, [&hw_thread_ids](unsigned i) { set_thread_affinity(hw_thread_ids[i]); });
+        t0 = __builtin_ia32_rdtsc();
+        executor.submit([&executor, depth]() { fork_tree(executor, depth); });
+    }
+    return __builtin_ia32_rdtsc() - t0;
+}
+
+template<class Executor>
+void run_executor_benchmark(char const* name, std::vector<unsigned> const& hw_thread_ids) {
+    int constexpr RUNS = 3;
+    unsigned constexpr DEPTH = 18;
+    unsigned constexpr TASKS = (2u << DEPTH) - 1;
+    for(unsigned workers = 1; workers <= hw_thread_ids.size(); ++workers) {
+        cycles_t min_time = std::numeric_limits<cycles_t>::max();
+        for(unsigned run = RUNS; run--;)
+            min_time = std::min(min_time, benchmark_executor<Executor>(hw_thread_ids, workers, DEPTH));
+        unsigned tasks_per_sec = TASKS / to_seconds(min_time);
+        std::printf("%32s,%2u: %'11u task/sec\n", name, workers, tasks_per_sec);
+    }
+}
+
+// The task throughput of the thread pools by the number of workers, pinned to a hardware thread each.
+void run_executor_benchmarks(std::vector<CpuTopologyInfo> const& cpu_topology) {
+    auto hw_thread_ids = hw_thread_id(cpu_topology); // Sorted by hw_thread_id: avoid HT, same socket.
+
+    std::printf("---- Running executor benchmarks (higher is better) ----\n");
+
+    run_executor_benchmark<SingleQueuePool>("SingleQueuePool", hw_thread_ids);
+    run_executor_benchmark<WorkStealingExecutor<>>("WorkStealingExecutor", hw_thread_ids);
+
+    std::printf("\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template<class Queue>
 void ping_pong_thread_impl(Queue* q1, Queue* q2, unsigned N, cycles_t* time, std::false_type /*sender*/) {
     cycles_t t0 = __builtin_ia32_rdtsc();
@@ -514,6 +893,8 @@ void run_ping_pong_benchmarks(HugePages& hp, std::vector<CpuTopologyInfo> const&
     run_ping_pong_benchmark<SPSC::AtomicQueueB2::type>("AtomicQueueB2", hp, hw_thread_ids);
     run_ping_pong_benchmark<SPSC::OptimistAtomicQueue2::type>("OptimistAtomicQueue2", hp, hw_thread_ids);
     run_ping_pong_benchmark<SPSC::OptimistAtomicQueueB2::type>("OptimistAtomicQueueB2", hp, hw_thread_ids);
+    run_ping_pong_benchmark<SPSC::OptimistAtomicQueueB2_64::type>("OptimistAtomicQueueB2<64>", hp, hw_thread_ids);
+    run_ping_pong_benchmark<SPSC::SpscAtomicQueue::type>("SpscAtomicQueue", hp, hw_thread_ids);
 
     // run_ping_pong_benchmark<RetryDecorator<AtomicQueueSpinlockHle<unsigned, SIZE>>>("SpinlockHle");
 
@@ -550,6 +931,9 @@ int main() {
     HugePageAllocatorBase::hp = &hp;
 
     run_throughput_benchmarks(hp, cpu_topology);
+    run_slot_layout_benchmarks(hp, cpu_topology);
+    run_residence_time_benchmarks(hp, cpu_topology);
+    run_executor_benchmarks(cpu_topology);
     run_ping_pong_benchmarks(hp, cpu_topology);
 }
 
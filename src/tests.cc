@@ -6,12 +6,34 @@
 #include <boost/test/unit_test.hpp>
 
 #include "atomic_queue/atomic_queue.h"
+#include "atomic_queue/atomic_queue16.h"
 #include "atomic_queue/atomic_queue_mutex.h"
 #include "atomic_queue/barrier.h"
+#include "atomic_queue/best_queue.h"
+#include "atomic_queue/conflating_queue.h"
+#include "atomic_queue/lossy_queue.h"
+#include "atomic_queue/merge_consumer.h"
+#include "atomic_queue/partitioned_queue.h"
+#include "atomic_queue/pipeline.h"
+#include "atomic_queue/residence_time.h"
+#include "atomic_queue/selector.h"
+#include "atomic_queue/spsc_queue.h"
+#include "atomic_queue/unbounded_queue.h"
+#include "atomic_queue/work_stealing.h"
+#include "shm/posix_shm_area.h"
 
+#ifdef __cpp_impl_coroutine
+#include "atomic_queue/async_queue.h"
+#endif
+
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <thread>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -73,6 +95,77 @@ void stress() {
     BOOST_CHECK_EQUAL(result_diff, 0);
 }
 
+// Same as stress, but with push_n/pop_n batches.
+template<class Queue, class... Args>
+void stress_batch(Args... args) {
+    constexpr int PRODUCERS = 3;
+    constexpr int CONSUMERS = 3;
+    constexpr unsigned BATCH = 16;
+    constexpr unsigned N = 160000;
+    static_assert(!(N % BATCH), "");
+
+    Queue q(args...);
+    Barrier barrier;
+    std::atomic<int> batches{static_cast<int>(PRODUCERS * N / BATCH)};
+
+    std::thread producers[PRODUCERS];
+    for(unsigned i = 0; i < PRODUCERS; ++i)
+        producers[i] = std::thread([&q, &barrier, N=N]() {
+            barrier.wait();
+            unsigned batch[BATCH];
+            for(unsigned n = N; n;) {
+                for(auto& b : batch)
+                    b = n--;
+                q.push_n(batch, batch + BATCH);
+            }
+        });
+
+    uint64_t results[CONSUMERS];
+    std::thread consumers[CONSUMERS];
+    for(unsigned i = 0; i < CONSUMERS; ++i)
+        consumers[i] = std::thread([&q, &barrier, &batches, &r = results[i]]() {
+            barrier.wait();
+            uint64_t result = 0;
+            unsigned batch[BATCH];
+            while(batches.fetch_sub(1, std::memory_order_relaxed) > 0) {
+                q.pop_n(batch, BATCH);
+                for(auto n : batch)
+                    result += n;
+            }
+            r = result;
+        });
+
+    barrier.release(PRODUCERS + CONSUMERS);
+
+    for(auto& t : producers)
+        t.join();
+    for(auto& t : consumers)
+        t.join();
+
+    constexpr uint64_t expected_result = (N + 1) / 2. * N * PRODUCERS;
+    uint64_t result = 0;
+    for(auto& r : results)
+        result += r;
+    BOOST_CHECK_EQUAL(result, expected_result);
+    BOOST_CHECK(q.was_empty());
+}
+
+template<class Q>
+void test_try_batch(Q& q) {
+    unsigned const capacity = q.capacity();
+    std::vector<unsigned> in(capacity + 2), out(capacity + 2);
+    for(unsigned i = 0; i < in.size(); ++i)
+        in[i] = i + 1;
+    BOOST_CHECK_EQUAL(q.try_pop_n(out.begin(), 1), 0u);
+    BOOST_CHECK_EQUAL(q.try_push_n(in.begin(), in.begin() + capacity - 1), capacity - 1);
+    BOOST_CHECK_EQUAL(q.try_push_n(in.begin() + capacity - 1, in.end()), 1u); // Only one slot left.
+    BOOST_CHECK(q.was_full());
+    BOOST_CHECK_EQUAL(q.try_pop_n(out.begin(), 2), 2u);
+    BOOST_CHECK_EQUAL(q.try_pop_n(out.begin() + 2, capacity + 2), capacity - 2);
+    BOOST_CHECK(q.was_empty());
+    BOOST_CHECK(std::equal(in.begin(), in.begin() + capacity, out.begin()));
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<class Q>
@@ -104,6 +197,60 @@ void test_unique_ptr_int(Q& q) {
     BOOST_CHECK_EQUAL(q.was_size(), 0u);
 }
 
+// Counts the copies and moves, which emplace and consume must not make.
+struct Message {
+    static int copies;
+
+    unsigned id = 0;
+    std::string text;
+
+    Message() noexcept = default;
+    Message(unsigned id, char const* text)
+        : id(id)
+        , text(text) {}
+
+    Message(Message const& b)
+        : id(b.id)
+        , text(b.text) {
+        ++copies;
+    }
+
+    Message& operator=(Message const& b) {
+        id = b.id;
+        text = b.text;
+        ++copies;
+        return *this;
+    }
+};
+
+int Message::copies = 0;
+
+template<class Q>
+void test_emplace_consume(Q& q) {
+    Message::copies = 0;
+    q.emplace(1u, "one");
+    BOOST_REQUIRE(q.try_emplace(2u, "two"));
+    BOOST_CHECK_EQUAL(q.was_size(), 2u);
+
+    unsigned id = 0;
+    std::string text;
+    q.consume([&](Message& m) {
+        id = m.id;
+        text = m.text;
+    });
+    BOOST_CHECK_EQUAL(id, 1u);
+    BOOST_CHECK_EQUAL(text, "one");
+    BOOST_REQUIRE(q.try_consume([&](Message const& m) { id = m.id; }));
+    BOOST_CHECK_EQUAL(id, 2u);
+    BOOST_CHECK(!q.try_consume([&](Message const&) { id = 0; }));
+    BOOST_CHECK_EQUAL(id, 2u);
+    BOOST_CHECK(q.was_empty());
+
+    q.emplace(3u, "three"); // Replaces the element left in the slot.
+    BOOST_CHECK_EQUAL(Message::copies, 0);
+    BOOST_CHECK_EQUAL(q.pop().id, 3u);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<class T, class State>
@@ -177,16 +324,277 @@ BOOST_AUTO_TEST_CASE(stress_BlockingAtomicQueue2) {
     stress<AtomicQueue2<unsigned, CAPACITY>>();
 }
 
+BOOST_AUTO_TEST_CASE(stress_wait_strategies) {
+    stress<AtomicQueue<unsigned, CAPACITY, 0, true, true, false, false, BackoffWait<>>>();
+    stress<AtomicQueue2<unsigned, CAPACITY, true, true, false, false, SlotLayout::SEPARATE, SpinYieldWait<>>>();
+    stress<AtomicQueue2<unsigned, CAPACITY, true, true, false, false, SlotLayout::SEPARATE, UmwaitWait<>>>();
+    stress<AtomicQueue2<unsigned, CAPACITY, true, true, false, false, SlotLayout::SEPARATE, AtomicWait<>>>();
+}
+
+namespace {
+
+// Counts the wait strategy calls of the queues with Tag.
+template<class Tag>
+struct CountingWait {
+    static std::atomic<unsigned>& calls() noexcept {
+        static std::atomic<unsigned> c{0};
+        return c;
+    }
+
+    template<class T>
+    void wait_while(std::atomic<T>&, T) noexcept {
+        calls().fetch_add(1, X);
+        std::this_thread::yield();
+    }
+
+    template<class T>
+    void wait_until(std::atomic<T>&, T) noexcept {
+        calls().fetch_add(1, X);
+        std::this_thread::yield();
+    }
+
+    template<class T>
+    static void notify(std::atomic<T>&) noexcept {}
+};
+
+// The consumer waits for the first element, the producer waits for the consumer to free a slot.
+template<class Queue>
+void spsc_wait(Queue& q) {
+    constexpr unsigned N = 100;
+    unsigned sum = 0;
+    std::thread consumer([&q, &sum]() {
+        for(unsigned n = N; n--;)
+            sum += q.pop();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    for(unsigned n = 1; n <= N; ++n)
+        q.push(n);
+    consumer.join();
+    BOOST_CHECK_EQUAL(sum, N * (N + 1) / 2);
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(spsc_wait_strategy) {
+    // SPSC=true and MAXIMIZE_THROUGHPUT=false, the configuration best_queue_t selects for 1 producer and 1 consumer.
+    using Wait1 = CountingWait<struct AtomicQueueTag>;
+    AtomicQueue<unsigned, 2, 0, false, false, false, true, Wait1> q1;
+    spsc_wait(q1);
+    BOOST_CHECK_GT(Wait1::calls().load(), 0u);
+
+    using Wait2 = CountingWait<struct AtomicQueue2Tag>;
+    AtomicQueue2<unsigned, 2, false, false, false, true, SlotLayout::SEPARATE, Wait2> q2;
+    spsc_wait(q2);
+    BOOST_CHECK_GT(Wait2::calls().load(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(posix_shm_numa_placement) {
+    // Node 0 exists on every host, with a single node or without NUMA support, where GetNUMANode returns -1.
+    shm::NUMAPlacement const placements[] = {{shm::NUMA_POLICY_NODE, 0}, {shm::NUMA_POLICY_INTERLEAVE}};
+    for(auto placement : placements) {
+        std::string const name = "atomic_queue_tests_numa_" + std::to_string(getpid()) + "_" + std::to_string(placement.policy);
+        shm::posix::POSIXSharedMemory<char> area(name, 1 << 16, placement);
+        BOOST_CHECK_EQUAL(area.GetNUMANode(), -1); // Not attached.
+        char* p = area.AttachSHM();
+        BOOST_REQUIRE(p);
+        std::memset(p, 1, 1 << 16); // First touch after mbind.
+        int const node = area.GetNUMANode();
+        if(placement.policy == shm::NUMA_POLICY_NODE)
+            BOOST_CHECK(node == 0 || node == -1);
+        else
+            BOOST_CHECK_GE(node, -1);
+        area.DeattachSHM();
+        BOOST_CHECK_EQUAL(area.GetNUMANode(), -1);
+        area.RemoveSHM();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stress_SeqAtomicQueue) {
+    stress<RetryDecorator<SeqAtomicQueue<unsigned, CAPACITY>>>();
+}
+
+BOOST_AUTO_TEST_CASE(stress_BlockingSeqAtomicQueue) {
+    stress<SeqAtomicQueue<unsigned, CAPACITY>>();
+}
+
+BOOST_AUTO_TEST_CASE(stress_UnboundedQueue) {
+    stress<RetryDecorator<UnboundedQueue<unsigned, 64>>>(); // Small segments to exercise segment recycling.
+}
+
+BOOST_AUTO_TEST_CASE(stress_BlockingUnboundedQueue) {
+    stress<UnboundedQueue<unsigned, 64>>();
+}
+
+BOOST_AUTO_TEST_CASE(stress_batch_AtomicQueue) {
+    stress_batch<AtomicQueue<unsigned, CAPACITY>>();
+}
+
+BOOST_AUTO_TEST_CASE(stress_batch_AtomicQueue2) {
+    stress_batch<AtomicQueue2<unsigned, CAPACITY>>();
+}
+
+BOOST_AUTO_TEST_CASE(stress_batch_AtomicQueueB) {
+    stress_batch<AtomicQueueB<unsigned>>(CAPACITY);
+}
+
+BOOST_AUTO_TEST_CASE(stress_batch_AtomicQueueB2) {
+    stress_batch<AtomicQueueB2<unsigned>>(CAPACITY);
+}
+
+BOOST_AUTO_TEST_CASE(stress_batch_AtomicQueue2_interleaved) {
+    stress_batch<AtomicQueue2<unsigned, CAPACITY, true, true, false, false, SlotLayout::INTERLEAVED>>();
+}
+
+BOOST_AUTO_TEST_CASE(stress_batch_AtomicQueueB2_padded) {
+    stress_batch<AtomicQueueB2<unsigned, std::allocator<unsigned>, true, false, false, SlotLayout::PADDED>>(CAPACITY);
+}
+
+BOOST_AUTO_TEST_CASE(try_batch) {
+    {
+        AtomicQueue<unsigned, 4, 0, false> q;
+        test_try_batch(q);
+    }
+    {
+        AtomicQueue2<unsigned, 4, false> q;
+        test_try_batch(q);
+    }
+    {
+        AtomicQueueB<unsigned> q(4);
+        test_try_batch(q);
+    }
+    {
+        AtomicQueueB2<unsigned> q(4);
+        test_try_batch(q);
+    }
+    {
+        AtomicQueue2<unsigned, 4, false, true, false, true> q; // SPSC.
+        test_try_batch(q);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(move_only_2) {
     AtomicQueue2<std::unique_ptr<int>, 2> q;
     test_unique_ptr_int(q);
 }
 
+BOOST_AUTO_TEST_CASE(move_only_slot_layouts) {
+    using P = std::unique_ptr<int>;
+    {
+        AtomicQueue2<P, 2, true, true, false, false, SlotLayout::INTERLEAVED> q;
+        test_unique_ptr_int(q);
+    }
+    {
+        AtomicQueue2<P, 2, true, true, false, false, SlotLayout::PADDED> q;
+        test_unique_ptr_int(q);
+    }
+    {
+        AtomicQueueB2<P, std::allocator<P>, true, false, false, SlotLayout::INTERLEAVED> q(2);
+        test_unique_ptr_int(q);
+    }
+    {
+        AtomicQueueB2<P, std::allocator<P>, true, false, false, SlotLayout::PADDED> q(2);
+        test_unique_ptr_int(q);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(move_only_seq) {
+    SeqAtomicQueue<std::unique_ptr<int>, 2> q;
+    test_unique_ptr_int(q);
+}
+
+BOOST_AUTO_TEST_CASE(seq_group) {
+    SeqAtomicQueue<unsigned, 8> q;
+    unsigned const group[] = {1, 2, 3};
+    unsigned out[8];
+    BOOST_CHECK_EQUAL(q.try_pop_n(out, 8), 0u);
+    q.push_group(group, group + 3);
+    BOOST_CHECK(q.try_push_group(group, group + 3));
+    BOOST_CHECK(!q.try_push_group(group, group + 3)); // 2 free slots.
+    BOOST_CHECK_EQUAL(q.was_size(), 6u);
+    BOOST_CHECK_EQUAL(q.try_pop_n(out, 2), 2u);
+    BOOST_CHECK_EQUAL(q.try_pop_n(out + 2, 8), 4u);
+    unsigned const expected[] = {1, 2, 3, 1, 2, 3};
+    BOOST_CHECK_EQUAL_COLLECTIONS(out, out + 6, expected, expected + 6);
+    BOOST_CHECK(q.was_empty());
+}
+
+// A consumer which sees the first element of a group can pop the rest of it without waiting.
+BOOST_AUTO_TEST_CASE(stress_seq_group) {
+    constexpr unsigned PRODUCERS = 3;
+    constexpr unsigned GROUPS = 5000;
+    struct Leg {
+        unsigned producer, group, size, leg;
+    };
+    SeqAtomicQueue<Leg, 64> q;
+    Barrier barrier;
+
+    std::thread producers[PRODUCERS];
+    for(unsigned p = 0; p < PRODUCERS; ++p)
+        producers[p] = std::thread([&q, &barrier, p]() {
+            barrier.wait();
+            Leg legs[8];
+            for(unsigned g = 0; g < GROUPS; ++g) {
+                unsigned size = 1 + (g + p) % 8;
+                for(unsigned i = 0; i < size; ++i)
+                    legs[i] = {p, g, size, i};
+                if(g % 2)
+                    q.push_group(legs, legs + size);
+                else
+                    while(!q.try_push_group(legs, legs + size))
+                        std::this_thread::yield();
+            }
+        });
+
+    barrier.release(PRODUCERS);
+    unsigned next_group[PRODUCERS] = {};
+    unsigned partial = 0, errors = 0;
+    for(unsigned groups = 0; groups < PRODUCERS * GROUPS; ++groups) {
+        Leg leg;
+        while(!q.try_pop(leg))
+            std::this_thread::yield();
+        errors += leg.leg != 0 || leg.group != next_group[leg.producer]++;
+        for(unsigned i = 1; i < leg.size; ++i) {
+            Leg next;
+            if(!q.try_pop(next)) {
+                ++partial;
+                while(!q.try_pop(next))
+                    spin_loop_pause();
+            }
+            errors += next.producer != leg.producer || next.group != leg.group || next.leg != i;
+        }
+    }
+    for(auto& t : producers)
+        t.join();
+    BOOST_CHECK_EQUAL(partial, 0u);
+    BOOST_CHECK_EQUAL(errors, 0u);
+    BOOST_CHECK(q.was_empty());
+}
+
+BOOST_AUTO_TEST_CASE(move_only_spsc) {
+    SpscAtomicQueue<std::unique_ptr<int>, 2> q;
+    test_unique_ptr_int(q);
+}
+
 BOOST_AUTO_TEST_CASE(move_only_b2) {
     AtomicQueueB2<std::unique_ptr<int>> q(2);
     test_unique_ptr_int(q);
 }
 
+BOOST_AUTO_TEST_CASE(emplace_consume) {
+    {
+        AtomicQueue2<Message, 2> q;
+        test_emplace_consume(q);
+    }
+    {
+        AtomicQueueB2<Message> q(2);
+        test_emplace_consume(q);
+    }
+    {
+        AtomicQueue2<Message, 2, true, true, false, true> q; // SPSC.
+        test_emplace_consume(q);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(allocator_constructor_only_b) {
     using allocator_type = test_stateful_allocator<int, std::string>;
     const auto allocator = allocator_type(nullptr, "Capybara");
@@ -266,4 +674,997 @@ BOOST_AUTO_TEST_CASE(power_of_2) {
     static_assert(round_up_to_power_of_2(0x40000000u + 1) == 0x80000000u, "");
 }
 
+BOOST_AUTO_TEST_CASE(fast_modulo) {
+    for(unsigned size : {1u, 2u, 3u, 7u, 256u, 600u, 768u, 1000000u, 0x7fffffffu, 0xfffffffeu, 0xffffffffu}) {
+        atomic_queue::details::FastModulo modulo(size);
+        bool exact = true;
+        for(unsigned index : {0u, 1u, size - 1, size, size + 1, 0x12345678u, 0x7fffffffu, 0x80000000u, 0xfffffffeu, 0xffffffffu})
+            exact &= modulo(index) == index % size;
+        for(unsigned index = 0; index < 100000; ++index)
+            exact &= modulo(index * 40503u) == index * 40503u % size;
+        BOOST_CHECK_MESSAGE(exact, "size " << size);
+    }
+}
+
+template<class Index>
+void test_ring_index(Index laps) {
+    for(unsigned size : {1u, 255u, 256u, 600u, 4096u, 5000u, 8192u}) {
+        atomic_queue::details::RingIndex<4, Index> index(size); // Blocks of 256 elements.
+        std::vector<unsigned> hits(size);
+        for(unsigned i = 0; i < size; ++i) {
+            Index j = index(i + size * laps);
+            if(j < size)
+                ++hits[j];
+        }
+        BOOST_CHECK_MESSAGE(std::all_of(hits.begin(), hits.end(), [](unsigned h) { return h == 1; }), "size " << size);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ring_index) {
+    test_ring_index(3u);
+    test_ring_index(UINT64_C(3) << 32);
+}
+
+BOOST_AUTO_TEST_CASE(arbitrary_capacity_b) {
+    {
+        AtomicQueueB<unsigned> q(atomic_queue::arbitrary_capacity, 600);
+        BOOST_CHECK_EQUAL(q.capacity(), 600u);
+        test_try_batch(q);
+    }
+    {
+        AtomicQueueB2<unsigned> q(atomic_queue::arbitrary_capacity, 600);
+        BOOST_CHECK_EQUAL(q.capacity(), 600u);
+        test_try_batch(q);
+    }
+    {
+        AtomicQueueB2<unsigned, std::allocator<unsigned>, true, false, false, SlotLayout::PADDED> q(atomic_queue::arbitrary_capacity, 5);
+        BOOST_CHECK_EQUAL(q.capacity(), 5u);
+        test_try_batch(q);
+    }
+    {
+        AtomicQueueB2<std::unique_ptr<int>> q(atomic_queue::arbitrary_capacity, 3);
+        test_unique_ptr_int(q);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stress_batch_AtomicQueueB2_arbitrary_capacity) {
+    stress_batch<AtomicQueueB2<unsigned>>(atomic_queue::arbitrary_capacity, CAPACITY * 3 / 4 + 1);
+}
+
+// Starts head_ and tail_ at index, rather than 0.
+template<class Queue>
+struct StartIndex : Queue {
+    template<class... Args>
+    StartIndex(typename Queue::index_type index, Args... args)
+        : Queue(args...) {
+        this->head_.store(index, std::memory_order_relaxed);
+        this->tail_.store(index, std::memory_order_relaxed);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(index64) {
+    using B64 = AtomicQueueB<unsigned, std::allocator<unsigned>, 0u, true, false, false, atomic_queue::SpinWait, uint64_t>;
+    using B2_64 = AtomicQueueB2<unsigned, std::allocator<unsigned>, true, false, false, SlotLayout::SEPARATE, atomic_queue::SpinWait, uint64_t>;
+    static_assert(std::is_same<decltype(std::declval<B2_64>().capacity()), uint64_t>::value, "");
+    constexpr uint64_t BELOW_2_32 = (UINT64_C(1) << 32) - 100; // The batches cross 2^32.
+    {
+        StartIndex<B64> q(BELOW_2_32, 1024);
+        test_try_batch(q);
+        BOOST_CHECK_EQUAL(q.was_size(), 0u);
+    }
+    {
+        StartIndex<B64> q(BELOW_2_32, atomic_queue::arbitrary_capacity, 600);
+        test_try_batch(q);
+    }
+    {
+        StartIndex<B2_64> q(BELOW_2_32, atomic_queue::arbitrary_capacity, 600);
+        test_try_batch(q);
+        q.push(1u);
+        BOOST_CHECK_EQUAL(q.was_size(), 1u);
+        BOOST_CHECK_EQUAL(q.pop(), 1u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(tokens) {
+    AtomicQueue2<unsigned, 64> q;
+    {
+        atomic_queue::ProducerToken<AtomicQueue2<unsigned, 64>> producer(q); // Blocks of 16.
+        for(unsigned n = 1; n <= 10; ++n)
+            producer.push(n);
+        BOOST_CHECK(q.was_empty());
+        BOOST_CHECK_EQUAL(producer.was_size(), 10u);
+        producer.flush();
+        BOOST_CHECK_EQUAL(q.was_size(), 10u);
+        for(unsigned n = 11; n <= 40; ++n)
+            producer.push(n);
+        BOOST_CHECK_EQUAL(q.was_size(), 26u);
+    }
+    BOOST_CHECK_EQUAL(q.was_size(), 40u); // Flushed by the destructor.
+
+    std::vector<unsigned> popped;
+    {
+        atomic_queue::ConsumerToken<AtomicQueue2<unsigned, 64>> consumer(q);
+        for(int i = 0; i < 6; ++i)
+            popped.push_back(consumer.pop());
+        BOOST_CHECK_EQUAL(consumer.was_size(), 10u);
+        BOOST_CHECK_EQUAL(q.was_size(), 24u);
+    }
+    BOOST_CHECK_EQUAL(q.was_size(), 34u); // The 10 claimed elements are pushed back.
+    for(unsigned n; q.try_pop(n);)
+        popped.push_back(n);
+    BOOST_CHECK_EQUAL(popped.size(), 40u);
+    std::sort(popped.begin(), popped.end());
+    for(unsigned n = 1; n <= 40; ++n)
+        BOOST_CHECK_EQUAL(popped[n - 1], n);
+
+    atomic_queue::ConsumerToken<AtomicQueue2<unsigned, 64>> consumer(q);
+    unsigned n;
+    BOOST_CHECK(!consumer.try_pop(n));
+}
+
+BOOST_AUTO_TEST_CASE(consumer_token_full_queue) {
+    // The token claims the elements of a full queue while the producer is blocked in push, pops one and is destroyed. Its
+    // destructor pushes the claimed elements back at indices whose slots still hold claimed elements, so it must pop them first.
+    using Queue = AtomicQueue2<unsigned, 4, false>;
+    constexpr unsigned N = 6;
+    Queue q;
+    std::atomic<unsigned> first{0}, claimed{0};
+    std::thread producer([&q]() {
+        for(unsigned n = 1; n <= N; ++n)
+            q.push(n);
+    });
+    std::thread consumer([&q, &first, &claimed]() {
+        while(q.was_size() < 5) // The producer has claimed index 4 and waits for slot 0.
+            std::this_thread::yield();
+        atomic_queue::ConsumerToken<Queue> token(q);
+        unsigned n;
+        while(!token.try_pop(n)) // Claims indices 0 to 4.
+            ;
+        claimed.store(token.was_size() + 1, X);
+        while(q.was_size() < 1) // The producer has stored 5 into slot 0, claimed index 5 and waits for slot 1.
+            std::this_thread::yield();
+        first.store(n, R);
+    });
+    while(!first.load(A))
+        std::this_thread::yield();
+    unsigned sum = first.load(X);
+    for(unsigned i = 1; i < N; ++i)
+        sum += q.pop();
+    producer.join();
+    consumer.join();
+    BOOST_CHECK_EQUAL(claimed.load(), 5u);
+    BOOST_CHECK_EQUAL(sum, N * (N + 1) / 2);
+    BOOST_CHECK(q.was_empty());
+}
+
+BOOST_AUTO_TEST_CASE(stress_tokens) {
+    constexpr int PRODUCERS = 3;
+    constexpr int CONSUMERS = 3;
+    constexpr unsigned N = 200000;
+    using Queue = AtomicQueueB2<unsigned>;
+
+    Queue q(CAPACITY);
+    Barrier barrier;
+    std::atomic<unsigned> popped{0};
+
+    std::thread producers[PRODUCERS];
+    for(unsigned i = 0; i < PRODUCERS; ++i)
+        producers[i] = std::thread([&q, &barrier]() {
+            barrier.wait();
+            atomic_queue::ProducerToken<Queue> producer(q);
+            for(unsigned n = N; n; --n)
+                producer.push(n);
+        });
+
+    uint64_t results[CONSUMERS];
+    std::thread consumers[CONSUMERS];
+    for(unsigned i = 0; i < CONSUMERS; ++i)
+        consumers[i] = std::thread([&q, &barrier, &popped, &r = results[i]]() {
+            barrier.wait();
+            atomic_queue::ConsumerToken<Queue> consumer(q);
+            uint64_t result = 0;
+            // Pop until all the elements are popped, so that the token does not push back claimed elements.
+            for(unsigned n; popped.load(std::memory_order_relaxed) != PRODUCERS * N;) {
+                if(consumer.try_pop(n)) {
+                    result += n;
+                    popped.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            r = result;
+        });
+
+    barrier.release(PRODUCERS + CONSUMERS);
+
+    for(auto& t : producers)
+        t.join();
+    for(auto& t : consumers)
+        t.join();
+
+    constexpr uint64_t expected_result = (N + 1) / 2. * N * PRODUCERS;
+    uint64_t result = 0;
+    for(auto& r : results)
+        result += r;
+    BOOST_CHECK_EQUAL(result, expected_result);
+    BOOST_CHECK(q.was_empty());
+}
+
+BOOST_AUTO_TEST_CASE(stress_batch_AtomicQueueB2_index64) {
+    stress_batch<AtomicQueueB2<unsigned, std::allocator<unsigned>, true, false, false, SlotLayout::SEPARATE, atomic_queue::SpinWait, uint64_t>>(CAPACITY);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+BOOST_AUTO_TEST_CASE(partitioned_queue_key_order) {
+    struct Message {
+        unsigned key, seq;
+    };
+    struct KeyOf {
+        unsigned operator()(Message const& m) const noexcept { return m.key; }
+    };
+
+    constexpr unsigned PARTITIONS = 4;
+    constexpr unsigned KEYS = 16;
+    constexpr unsigned N = 20000; // Messages per key.
+    using Queue = PartitionedQueue<AtomicQueue2<Message, 1024, false, false, false, true>, PARTITIONS, KeyOf>;
+    Queue q;
+
+    unsigned expected[PARTITIONS] = {};
+    for(unsigned key = 0; key < KEYS; ++key)
+        expected[q.partition_of(Message{key, 0})] += N;
+
+    Barrier barrier;
+    std::thread producer([&q, &barrier]() {
+        barrier.wait();
+        std::vector<Message> batch;
+        for(unsigned seq = 0; seq < N; ++seq) {
+            for(unsigned key = 0; key < KEYS; ++key) {
+                Message m{key, seq};
+                if(seq % 2) // Exercise both the single element and the batch routing.
+                    batch.push_back(m);
+                else
+                    q.push(m);
+            }
+            q.push(batch.begin(), batch.end());
+            batch.clear();
+        }
+    });
+
+    bool ordered[PARTITIONS];
+    std::thread consumers[PARTITIONS];
+    for(unsigned i = 0; i < PARTITIONS; ++i)
+        consumers[i] = std::thread([&q, &barrier, &expected, &ordered, i]() {
+            barrier.wait();
+            unsigned next_seq[KEYS] = {};
+            bool o = true;
+            for(unsigned n = expected[i]; n; --n) {
+                Message m = q.pop(i);
+                o &= q.partition_of(m) == i;
+                o &= m.seq == next_seq[m.key]++;
+            }
+            ordered[i] = o;
+        });
+
+    barrier.release(1 + PARTITIONS);
+    producer.join();
+    for(auto& t : consumers)
+        t.join();
+
+    for(unsigned i = 0; i < PARTITIONS; ++i)
+        BOOST_CHECK(ordered[i]);
+    BOOST_CHECK(q.was_empty());
+}
+
+namespace {
+
+// Counts the push_n calls of the PartitionedQueue range push.
+struct CountingPartition : AtomicQueue2<unsigned, 256, false, false, false, true> {
+    unsigned push_n_calls = 0;
+
+    template<class ForwardIt>
+    void push_n(ForwardIt first, ForwardIt last) noexcept {
+        ++push_n_calls;
+        AtomicQueue2::push_n(first, last);
+    }
+};
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(partitioned_queue_range_push) {
+    struct KeyOf {
+        unsigned operator()(unsigned n) const noexcept { return n % 8; }
+    };
+
+    PartitionedQueue<CountingPartition, 4, KeyOf> q;
+    std::vector<unsigned> elements(100);
+    for(unsigned n = 0; n < 100; ++n)
+        elements[n] = n;
+    q.push(elements.begin(), elements.end()); // Batches of 64 and 36 elements.
+
+    unsigned calls = 0, popped = 0;
+    for(unsigned p = 0; p < 4; ++p) {
+        calls += q[p].push_n_calls;
+        unsigned n, previous = 0, count = 0;
+        for(; q.try_pop(p, n); previous = n, ++count) {
+            BOOST_CHECK_EQUAL(q.partition_of(n), p);
+            BOOST_CHECK(!count || n > previous); // In the order pushed.
+        }
+        popped += count;
+    }
+    BOOST_CHECK_EQUAL(popped, 100u);
+    BOOST_CHECK_LE(calls, 8u); // At most one per partition per batch.
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+BOOST_AUTO_TEST_CASE(merge_consumer_order) {
+    struct Message {
+        unsigned key, input;
+    };
+    struct KeyOf {
+        unsigned operator()(Message const& m) const noexcept { return m.key; }
+    };
+
+    constexpr unsigned INPUTS = 3;
+    constexpr unsigned N = 100000; // Messages per input.
+    using Queue = AtomicQueue2<Message, 256, false, false, false, true>;
+    Queue queues[INPUTS];
+    MergeConsumer<Queue, INPUTS, KeyOf> merge(queues[0], queues[1], queues[2]);
+
+    Barrier barrier;
+    std::thread producers[INPUTS];
+    for(unsigned i = 0; i < INPUTS; ++i)
+        producers[i] = std::thread([&queues, &merge, &barrier, i]() {
+            barrier.wait();
+            unsigned key = 0;
+            for(unsigned n = 0; n < N; ++n) {
+                key += (n * 7 + i) % 3; // Equal keys within and across inputs.
+                queues[i].push(Message{key, i});
+                if(i == INPUTS - 1 && n == N / 2) { // Go idle for a while, the other inputs proceed up to the heartbeat key.
+                    merge.heartbeat(i, key);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+            }
+            merge.close(i);
+        });
+
+    barrier.release(INPUTS);
+    Message prev{0, 0};
+    unsigned count = 0;
+    bool ordered = true;
+    for(Message m; merge.pop(m); ++count) {
+        ordered &= prev.key < m.key || (prev.key == m.key && prev.input <= m.input);
+        prev = m;
+    }
+    for(auto& t : producers)
+        t.join();
+
+    BOOST_CHECK(ordered);
+    BOOST_CHECK_EQUAL(count, INPUTS * N);
+    BOOST_CHECK(merge.done());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+BOOST_AUTO_TEST_CASE(conflating_queue) {
+    struct Update {
+        unsigned key, version;
+    };
+    struct KeyOf {
+        unsigned operator()(Update const& u) const noexcept { return u.key; }
+    };
+
+    {
+        ConflatingQueue<Update, 2, KeyOf> q;
+        BOOST_CHECK(q.try_push(Update{1, 1}));
+        BOOST_CHECK(q.try_push(Update{2, 1}));
+        BOOST_CHECK(q.try_push(Update{1, 2})); // Overwrites the pending update of key 1 in place.
+        BOOST_CHECK(!q.try_push(Update{3, 1})); // The key table is full.
+        BOOST_CHECK_EQUAL(q.was_size(), 2u);
+        Update u;
+        BOOST_CHECK(q.try_pop(u));
+        BOOST_CHECK_EQUAL(u.key, 1u);
+        BOOST_CHECK_EQUAL(u.version, 2u);
+        BOOST_CHECK(q.try_pop(u));
+        BOOST_CHECK_EQUAL(u.key, 2u);
+        BOOST_CHECK(!q.try_pop(u));
+    }
+
+    {
+        ConflatingQueue<Update, 3, KeyOf> q; // KEYS is rounded up to a power of 2.
+        BOOST_CHECK_EQUAL(q.capacity(), 4u);
+        for(unsigned key = 0; key < 4; ++key)
+            BOOST_CHECK(q.try_push(Update{key, 1}));
+        BOOST_CHECK(!q.try_push(Update{4, 1}));
+    }
+
+    constexpr unsigned PRODUCERS = 2;
+    constexpr unsigned KEYS = 8; // Per producer.
+    constexpr unsigned N = 100000; // Updates per key.
+    ConflatingQueue<Update, PRODUCERS * KEYS, KeyOf> q;
+    Barrier barrier;
+    std::thread producers[PRODUCERS];
+    for(unsigned i = 0; i < PRODUCERS; ++i)
+        producers[i] = std::thread([&q, &barrier, i]() {
+            barrier.wait();
+            for(unsigned version = 1; version <= N; ++version)
+                for(unsigned key = i * KEYS; key < (i + 1) * KEYS; ++key)
+                    q.try_push(Update{key, version});
+        });
+    std::atomic<bool> stop{false};
+    unsigned last[PRODUCERS * KEYS] = {};
+    bool ordered = true;
+    std::thread consumer([&]() {
+        barrier.wait();
+        for(;;) {
+            bool done = stop.load(std::memory_order_acquire);
+            Update u;
+            while(q.try_pop(u)) {
+                ordered &= u.version > last[u.key];
+                last[u.key] = u.version;
+            }
+            if(done)
+                break;
+        }
+    });
+
+    barrier.release(PRODUCERS + 1);
+    for(auto& t : producers)
+        t.join();
+    stop.store(true, std::memory_order_release);
+    consumer.join();
+
+    BOOST_CHECK(ordered);
+    for(unsigned version : last)
+        BOOST_CHECK_EQUAL(version, N); // The latest update of each key is always delivered.
+    BOOST_CHECK(q.was_empty());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+BOOST_AUTO_TEST_CASE(lossy_queue) {
+    struct Sample {
+        uint64_t value, check;
+    };
+
+    {
+        LossyAtomicQueue<Sample, 4> q;
+        for(uint64_t i = 0; i < 10; ++i)
+            q.push(Sample{i, ~i}); // Never blocks, overwrites the oldest samples.
+        Sample s;
+        uint64_t lost = 0;
+        for(uint64_t i = 6; i < 10; ++i) {
+            BOOST_CHECK(q.try_pop(s, lost));
+            BOOST_CHECK_EQUAL(s.value, i);
+        }
+        BOOST_CHECK_EQUAL(lost, 6u);
+        BOOST_CHECK(!q.try_pop(s, lost));
+        BOOST_CHECK(q.was_empty());
+    }
+
+    constexpr uint64_t N = 1000000;
+    LossyAtomicQueue<Sample, 64> q;
+    Barrier barrier;
+    std::atomic<bool> done{false};
+    std::thread producer([&q, &barrier, &done]() {
+        barrier.wait();
+        for(uint64_t i = 0; i < N; ++i)
+            q.push(Sample{i, ~i});
+        done.store(true, std::memory_order_release);
+    });
+
+    barrier.release(1);
+    uint64_t received = 0, lost = 0, expected = 0;
+    bool consistent = true;
+    for(Sample s;;) {
+        bool stop = done.load(std::memory_order_acquire);
+        uint64_t lost_before = lost;
+        if(q.try_pop(s, lost)) {
+            ++received;
+            consistent &= s.check == ~s.value; // Not torn.
+            consistent &= s.value == expected + lost - lost_before; // The gaps are accounted for.
+            expected = s.value + 1;
+        }
+        else if(stop) {
+            break;
+        }
+    }
+    producer.join();
+
+    BOOST_CHECK(consistent);
+    BOOST_CHECK_EQUAL(received + lost, N);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+BOOST_AUTO_TEST_CASE(spsc_queue_batch_publication) {
+    constexpr unsigned N = 100003;
+    SpscAtomicQueue<unsigned, 64, 16> q;
+    Barrier barrier;
+    std::thread producer([&q, &barrier]() {
+        barrier.wait();
+        for(unsigned n = 1; n <= N; ++n)
+            q.push(n);
+        q.flush(); // N is not a multiple of the publication batch.
+    });
+
+    barrier.release(1);
+    bool ordered = true;
+    for(unsigned n = 1; n <= N; ++n)
+        ordered &= q.pop() == n;
+    producer.join();
+
+    BOOST_CHECK(ordered);
+    unsigned n;
+    BOOST_CHECK(!q.try_pop(n)); // Publishes the consumer index.
+    BOOST_CHECK(q.was_empty());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+BOOST_AUTO_TEST_CASE(unbounded_queue) {
+    UnboundedQueue<std::unique_ptr<int>, 4> q;
+    for(int round = 0; round < 3; ++round) { // Later rounds reuse the drained segments.
+        for(int i = 0; i < 10; ++i)
+            q.push(std::unique_ptr<int>(new int(i)));
+        BOOST_CHECK(!q.was_empty());
+        std::unique_ptr<int> p;
+        for(int i = 0; i < 10; ++i) {
+            BOOST_REQUIRE(q.try_pop(p));
+            BOOST_CHECK_EQUAL(*p, i);
+        }
+        BOOST_CHECK(!q.try_pop(p));
+        BOOST_CHECK(q.was_empty());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+BOOST_AUTO_TEST_CASE(atomic_queue16) {
+    struct Pair {
+        uint64_t value, check;
+    };
+
+    {
+        // The lock table fallback.
+        details::Atomic16 a;
+        details::Words16 expected = {1, 2};
+        BOOST_CHECK(!details::cas16_locked(a, expected, {3, 4}));
+        BOOST_CHECK(expected == details::Words16({0, 0}));
+        BOOST_CHECK(details::cas16_locked(a, expected, {3, 4}));
+        BOOST_CHECK(a.load_torn() == details::Words16({3, 4}));
+    }
+
+    constexpr unsigned PRODUCERS = 2;
+    constexpr unsigned CONSUMERS = 2;
+    constexpr uint64_t N = 50000;
+    AtomicQueue16<Pair, 64> q;
+    Barrier barrier;
+    std::thread producers[PRODUCERS];
+    for(unsigned i = 0; i < PRODUCERS; ++i)
+        producers[i] = std::thread([&q, &barrier]() {
+            barrier.wait();
+            for(uint64_t n = 1; n <= N; ++n)
+                q.push(Pair{n, ~n});
+        });
+    uint64_t sums[CONSUMERS];
+    bool consistent[CONSUMERS];
+    std::thread consumers[CONSUMERS];
+    for(unsigned i = 0; i < CONSUMERS; ++i)
+        consumers[i] = std::thread([&q, &barrier, &sum = sums[i], &ok = consistent[i]]() {
+            barrier.wait();
+            sum = 0;
+            ok = true;
+            for(uint64_t n = N * PRODUCERS / CONSUMERS; n--;) {
+                Pair p = q.pop();
+                ok &= p.check == ~p.value; // Not torn.
+                sum += p.value;
+            }
+        });
+
+    barrier.release(PRODUCERS + CONSUMERS);
+    for(auto& t : producers)
+        t.join();
+    for(auto& t : consumers)
+        t.join();
+
+    uint64_t sum = 0;
+    for(unsigned i = 0; i < CONSUMERS; ++i) {
+        BOOST_CHECK(consistent[i]);
+        sum += sums[i];
+    }
+    BOOST_CHECK_EQUAL(sum, PRODUCERS * (N + 1) * N / 2);
+    BOOST_CHECK(q.was_empty());
+}
+
+BOOST_AUTO_TEST_CASE(best_queue) {
+    struct Pair {
+        uint64_t value, check;
+    };
+
+    // AtomicQueue only with an explicit NIL, so that no element value is forbidden by default.
+    static_assert(std::is_same<best_queue_t<unsigned, 64, 1, 1>, AtomicQueue2<unsigned, 64, false, false, false, true>>::value, "");
+    static_assert(std::is_same<best_queue_t<int, 64, 2, 2>, AtomicQueue2<int, 64, true, true, false, false>>::value, "");
+    static_assert(std::is_same<best_queue_t<unsigned, 64, 1, 1, Nil<unsigned, 0u>>, AtomicQueue<unsigned, 64, 0u, false, false, false, true>>::value, "");
+    static_assert(std::is_same<best_queue_t<int, 64, 2, 2, Nil<int, -1>>, AtomicQueue<int, 64, -1, true, true, false, false>>::value, "");
+    static_assert(std::is_same<best_queue_t<Pair, 64, 1, 1>, AtomicQueue2<Pair, 64, false, false, false, true>>::value, "");
+    static_assert(std::is_same<best_queue_t<unsigned*, 64, 2, 1, Nil<unsigned*, nullptr>>, AtomicQueue<unsigned*, 64, nullptr, true, true, false, false>>::value, "");
+    static_assert(std::is_same<best_queue_t<double, 64, 1, 2>, AtomicQueue2<double, 64, true, true, false, false>>::value, "");
+    static_assert(std::is_same<details::QueueOfKind<QueueKind::SPSC_ATOMIC_QUEUE, Pair, 64, true, false, false>::type, SpscAtomicQueue<Pair, 64>>::value, "");
+
+    best_queue_t<Pair, 64, 2, 2> q;
+    for(uint64_t n = 1; n <= 3; ++n)
+        q.push(Pair{n, ~n});
+    for(uint64_t n = 1; n <= 3; ++n) {
+        Pair p = q.pop();
+        BOOST_CHECK_EQUAL(p.value, n);
+        BOOST_CHECK_EQUAL(p.check, ~n);
+    }
+    BOOST_CHECK(q.was_empty());
+
+    best_queue_t<int, 64, 2, 2> ints; // 0 is a valid element without a NIL.
+    for(int n = -1; n <= 1; ++n)
+        ints.push(n);
+    for(int n = -1; n <= 1; ++n)
+        BOOST_CHECK_EQUAL(ints.pop(), n);
+}
+
+BOOST_AUTO_TEST_CASE(residence_histogram) {
+    using H = ResidenceHistogram;
+    for(uint64_t v : {UINT64_C(0), UINT64_C(1), UINT64_C(15), UINT64_C(16), UINT64_C(31), UINT64_C(32), UINT64_C(33), UINT64_C(1000), UINT64_C(123456789),
+                      UINT64_MAX}) {
+        unsigned b = H::bucket(v);
+        BOOST_REQUIRE(b < H::BUCKETS);
+        BOOST_CHECK_LE(v, H::bucket_max(b));
+        BOOST_CHECK(!b || H::bucket_max(b - 1) < v);
+        BOOST_CHECK_LE(H::bucket_max(b) - v, v >> H::SUB_BITS); // The relative error.
+    }
+    BOOST_CHECK_EQUAL(H::bucket_max(H::BUCKETS - 1), UINT64_MAX);
+
+    H histogram, total_histogram;
+    H* h = &histogram;
+    H* total = &total_histogram;
+    BOOST_CHECK_EQUAL(h->percentile(.5), 0u);
+    for(uint64_t v = 1; v <= 1000; ++v)
+        h->record(v);
+    BOOST_CHECK_EQUAL(h->count(), 1000u);
+    BOOST_CHECK_EQUAL(h->percentile(0), 1u);
+    BOOST_CHECK_EQUAL(h->percentile(.01), 10u);
+    BOOST_CHECK_GE(h->percentile(.5), 500u);
+    BOOST_CHECK_LE(h->percentile(.5), 500u + 500 / H::SUB_BUCKETS);
+    BOOST_CHECK_GE(h->percentile(.999), 999u);
+    BOOST_CHECK_GE(h->percentile(1), 1000u);
+
+    total->add(*h);
+    total->add(*h);
+    BOOST_CHECK_EQUAL(total->count(), 2000u);
+    BOOST_CHECK_EQUAL(total->percentile(.5), h->percentile(.5));
+    h->reset();
+    BOOST_CHECK_EQUAL(h->count(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(residence_time) {
+    struct Message {
+        unsigned value;
+    };
+    static_assert(sizeof(AtomicQueue2<TscStamped<Message>, 64>) > sizeof(AtomicQueue2<Message, 64>), "");
+    static_assert(sizeof(ResidenceTimeQueue<AtomicQueue2<Message, 64>>) == sizeof(AtomicQueue2<Message, 64>), "");
+
+    ResidenceHistogram histogram;
+    ResidenceHistogram* h = &histogram;
+    {
+        ResidenceTimeQueue<AtomicQueue2<Message, 64>> q; // Not stamped.
+        q.push(Message{1});
+        BOOST_CHECK(q.try_push(Message{2}));
+        BOOST_CHECK_EQUAL(q.pop(*h).value, 1u);
+        Message m;
+        BOOST_CHECK(q.try_pop(m, *h));
+        BOOST_CHECK_EQUAL(m.value, 2u);
+        BOOST_CHECK_EQUAL(h->count(), 0u);
+    }
+
+    ResidenceTimeQueue<AtomicQueueB2<TscStamped<std::unique_ptr<unsigned>>>> q(64);
+    q.push(std::unique_ptr<unsigned>(new unsigned(1)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    BOOST_CHECK(q.try_push(std::unique_ptr<unsigned>(new unsigned(2))));
+    BOOST_CHECK_EQUAL(*q.pop(*h), 1u);
+    std::unique_ptr<unsigned> p;
+    BOOST_CHECK(q.try_pop(p, *h));
+    BOOST_CHECK_EQUAL(*p, 2u);
+    BOOST_CHECK(!q.try_pop(p, *h));
+    BOOST_CHECK_EQUAL(h->count(), 2u);
+    // The first element waited for at least 2ms, at least 2e5 ticks of any clock faster than 100MHz.
+    BOOST_CHECK_GE(h->percentile(1), 200000u);
+}
+
+BOOST_AUTO_TEST_CASE(queue_stats) {
+    static_assert(std::is_same<AtomicQueue2<unsigned, 4>, AtomicQueue2<unsigned, 4, true, true, false, false, SlotLayout::SEPARATE, SpinWait, NoStats>>::value, "");
+
+    struct Tag2;
+    struct TagB;
+    using Stats2 = CountingStats<Tag2>;
+    using StatsB = CountingStats<TagB>;
+    QueueStats const s0 = Stats2::get();
+
+    AtomicQueue2<unsigned, 4, true, true, false, false, SlotLayout::SEPARATE, SpinWait, Stats2> q;
+    unsigned e;
+    BOOST_CHECK(!q.try_pop(e));
+    for(unsigned i = 1; i <= 4; ++i)
+        BOOST_CHECK(q.try_push(i));
+    BOOST_CHECK(!q.try_push(5u));
+    unsigned a[4];
+    BOOST_CHECK_EQUAL(q.try_pop_n(a, 4), 4u);
+    BOOST_CHECK_EQUAL(q.try_pop_n(a, 4), 0u);
+
+    QueueStats s = Stats2::get() - s0;
+    BOOST_CHECK_EQUAL(s.empty, 2u);
+    BOOST_CHECK_EQUAL(s.full, 1u);
+    BOOST_CHECK_EQUAL(s.cas_failures, 0u);
+    BOOST_CHECK_EQUAL(s.spins, 0u);
+
+    // The counters of a thread which has exited.
+    std::thread consumer([&q, &e]() { e = q.pop(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    q.push(7u);
+    consumer.join();
+    BOOST_CHECK_EQUAL(e, 7u);
+    s = Stats2::get() - s0;
+    BOOST_CHECK_GT(s.spins, 0u);
+    BOOST_CHECK_EQUAL(s.empty, 2u);
+
+    AtomicQueueB<unsigned, std::allocator<unsigned>, 0u, true, false, false, SpinWait, unsigned, StatsB> qb(4);
+    BOOST_CHECK(!qb.try_pop(e));
+    BOOST_CHECK_EQUAL(StatsB::get().empty, 1u);
+    BOOST_CHECK_EQUAL(StatsB::get().spins, 0u);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+BOOST_AUTO_TEST_CASE(chase_lev_deque) {
+    ChaseLevDeque<unsigned*, 4> d;
+    unsigned e[5] = {0, 1, 2, 3, 4};
+    unsigned* p;
+    BOOST_CHECK(!d.take(p));
+    BOOST_CHECK(!d.steal(p));
+    for(unsigned i = 0; i < 4; ++i)
+        BOOST_CHECK(d.push(&e[i]));
+    BOOST_CHECK(!d.push(&e[4]));
+    BOOST_CHECK(d.steal(p)); // FIFO.
+    BOOST_CHECK_EQUAL(*p, 0u);
+    BOOST_CHECK(d.take(p)); // LIFO.
+    BOOST_CHECK_EQUAL(*p, 3u);
+    BOOST_CHECK(d.push(&e[4]));
+    BOOST_CHECK_EQUAL(d.was_size(), 3u);
+    for(unsigned expected : {4u, 2u, 1u}) {
+        BOOST_CHECK(d.take(p));
+        BOOST_CHECK_EQUAL(*p, expected);
+    }
+    BOOST_CHECK(!d.take(p));
+
+    // Every element is either taken by the owner or stolen by one thief.
+    constexpr unsigned N = 20000;
+    ChaseLevDeque<uintptr_t, 64> d2;
+    std::atomic<bool> done{false};
+    std::atomic<uint64_t> stolen{0};
+    auto thief = [&]() {
+        for(uintptr_t e; !done.load(A);)
+            if(d2.steal(e))
+                stolen.fetch_add(e, X);
+            else
+                std::this_thread::yield();
+    };
+    std::thread thieves[2] = {std::thread(thief), std::thread(thief)};
+    uint64_t taken = 0;
+    for(uintptr_t i = 1; i <= N; ++i) {
+        while(!d2.push(i))
+            std::this_thread::yield();
+        uintptr_t e;
+        if(i % 3 == 0 && d2.take(e))
+            taken += e;
+    }
+    for(uintptr_t e; d2.take(e);)
+        taken += e;
+    while(d2.was_size())
+        std::this_thread::yield();
+    done.store(true, R);
+    for(auto& t : thieves)
+        t.join();
+    BOOST_CHECK_EQUAL(taken + stolen.load(), uint64_t{N} * (N + 1) / 2);
+}
+
+namespace {
+
+template<class Executor>
+void fork_tree(Executor& e, unsigned depth, std::atomic<unsigned>& leaves) {
+    if(!depth)
+        leaves.fetch_add(1, X);
+    else
+        for(int i = 2; i--;)
+            e.submit([&e, depth, &leaves]() { fork_tree(e, depth - 1, leaves); });
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(work_stealing_executor) {
+    constexpr unsigned DEPTH = 12, EXTERNAL = 1000;
+    std::atomic<unsigned> leaves{0}, external{0}, started{0};
+    {
+        // Small deques and injection queue for the tasks to overflow them.
+        WorkStealingExecutor<std::function<void()>, 16> executor(3, 64, [&started](unsigned) { started.fetch_add(1, X); });
+        BOOST_CHECK_EQUAL(executor.worker_count(), 3u);
+        executor.submit([&]() { fork_tree(executor, DEPTH, leaves); });
+        for(unsigned i = 0; i < EXTERNAL; ++i)
+            executor.submit([&external]() { external.fetch_add(1, X); });
+    } // Runs all the tasks.
+    BOOST_CHECK_EQUAL(started.load(), 3u);
+    BOOST_CHECK_EQUAL(leaves.load(), 1u << DEPTH);
+    BOOST_CHECK_EQUAL(external.load(), EXTERNAL);
+}
+
+BOOST_AUTO_TEST_CASE(pipeline) {
+    constexpr unsigned N = 30000;
+    using Q1 = AtomicQueue2<unsigned, 256>;
+    using Q2 = AtomicQueueB2<uint64_t>;
+    std::atomic<unsigned> started{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<unsigned> first{1};
+    Pipeline pipeline([&started](unsigned thread) { started.fetch_or(1u << thread, X); });
+    // Two sources push the odd and the even numbers.
+    auto numbers = pipeline.source<Q1>("numbers", 2, [&first](Pipeline::Output<Q1>& out) {
+        for(unsigned n = first.fetch_add(1, X); n <= N; n += 2)
+            out.push(n);
+    });
+    // Drops the multiples of 3, a small queue to make the threads wait for each other.
+    auto squares = pipeline.stage<Q2>("squares", 2, numbers, [](unsigned n, Pipeline::Output<Q2>& out) {
+        if(n % 3)
+            out.push(uint64_t{n} * n);
+    }, 16);
+    pipeline.sink("sum", 2, squares, [&sum](uint64_t n) { sum.fetch_add(n, X); });
+    pipeline.run();
+
+    uint64_t expected_sum = 0, expected_squares = 0;
+    for(uint64_t n = 1; n <= N; ++n)
+        if(n % 3) {
+            expected_sum += n * n;
+            ++expected_squares;
+        }
+    BOOST_CHECK_EQUAL(started.load(), 0x3fu);
+    BOOST_CHECK_EQUAL(sum.load(), expected_sum);
+
+    auto stats = pipeline.stats();
+    BOOST_REQUIRE_EQUAL(stats.size(), 3u);
+    BOOST_CHECK_EQUAL(stats[1].name, "squares");
+    BOOST_CHECK_EQUAL(stats[1].threads, 2u);
+    for(auto& s : stats) {
+        BOOST_CHECK_EQUAL(s.elements, s.name == "sum" ? expected_squares : N);
+        BOOST_CHECK_GE(s.seconds, 0);
+        BOOST_CHECK(s.occupancy >= 0 && s.occupancy <= 1);
+    }
+    BOOST_CHECK_EQUAL(stats[0].occupancy, 0);
+}
+
+BOOST_AUTO_TEST_CASE(selector) {
+    SelectableQueue<AtomicQueue2<unsigned, 64>> control;
+    SelectableQueue<AtomicQueueB2<unsigned>> data(1024);
+    Selector<SpinYieldWait<>> selector;
+    BOOST_CHECK_EQUAL(selector.add(control), 0u);
+    data.push(1u); // Before add.
+    BOOST_CHECK_EQUAL(selector.add(data), 1u);
+    BOOST_CHECK_EQUAL(selector.size(), 2u);
+
+    BOOST_CHECK_EQUAL(selector.try_select(), 1);
+    control.push(2u);
+    BOOST_CHECK_EQUAL(selector.select(), 0u); // The queue added first takes priority.
+    BOOST_CHECK_EQUAL(control.pop(), 2u);
+    BOOST_CHECK_EQUAL(selector.select(), 1u);
+    BOOST_CHECK_EQUAL(data.pop(), 1u);
+    BOOST_CHECK_EQUAL(selector.try_select(), -1);
+
+    // A consumer of both queues, with producers of each.
+    constexpr unsigned N = 100000, M = 1000;
+    std::thread data_producer([&data]() {
+        unsigned elements[16];
+        for(unsigned i = 1; i <= N; i += 16) {
+            for(unsigned j = 0; j < 16; ++j)
+                elements[j] = i + j;
+            data.push_n(elements, elements + std::min(16u, N + 1 - i));
+        }
+    });
+    std::thread control_producer([&control]() {
+        for(unsigned i = 1; i <= M; ++i) {
+            control.push(i);
+            std::this_thread::yield();
+        }
+    });
+    uint64_t data_sum = 0, control_sum = 0;
+    unsigned data_count = 0, control_count = 0;
+    for(unsigned element; data_count < N || control_count < M;) {
+        if(!selector.select()) {
+            BOOST_REQUIRE(control.try_pop(element));
+            control_sum += element;
+            ++control_count;
+        }
+        else {
+            BOOST_REQUIRE(data.try_pop(element));
+            data_sum += element;
+            ++data_count;
+        }
+    }
+    data_producer.join();
+    control_producer.join();
+    BOOST_CHECK_EQUAL(data_sum, uint64_t{N} * (N + 1) / 2);
+    BOOST_CHECK_EQUAL(control_sum, uint64_t{M} * (M + 1) / 2);
+    BOOST_CHECK_EQUAL(selector.try_select(), -1);
+}
+
+// Build the tests with make CXXFLAGS=-std=gnu++20 to run this one.
+#ifdef __cpp_impl_coroutine
+
+namespace {
+
+// A coroutine which starts eagerly and destroys itself on completion.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+template<class Queue>
+Detached async_consumer(Queue& q, unsigned n, std::atomic<uint64_t>& sum, std::atomic<unsigned>& done) {
+    for(unsigned i = 0; i < n; ++i)
+        sum.fetch_add(co_await q.async_pop(), X);
+    done.fetch_add(1, R);
+}
+
+template<class Queue>
+Detached async_producer(Queue& q, unsigned first, unsigned n, std::atomic<unsigned>& done) {
+    for(unsigned i = first; i < first + n; ++i)
+        co_await q.async_push(i);
+    done.fetch_add(1, R);
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(async_queue) {
+    constexpr unsigned CONSUMERS = 8, PRODUCERS = 4, N = 1000; // Elements per producer.
+    constexpr uint64_t SUM = uint64_t{PRODUCERS} * N * (PRODUCERS * N - 1) / 2;
+    using Queue = AsyncQueue<AtomicQueue2<unsigned, 4, false>>;
+
+    // The consumers suspend on the empty queue and the producers on the full one. The threads of the producers resume them.
+    Queue q;
+    std::atomic<uint64_t> sum{0};
+    std::atomic<unsigned> consumed{0}, produced{0};
+    for(unsigned i = 0; i < CONSUMERS; ++i)
+        async_consumer(q, PRODUCERS * N / CONSUMERS, sum, consumed);
+    BOOST_CHECK_EQUAL(consumed.load(), 0u);
+    std::thread producers[PRODUCERS];
+    for(unsigned i = 0; i < PRODUCERS; ++i)
+        producers[i] = std::thread([&q, &produced, i]() { async_producer(q, i * N, N, produced); });
+    for(auto& t : producers)
+        t.join();
+    BOOST_CHECK_EQUAL(produced.load(), PRODUCERS);
+    BOOST_CHECK_EQUAL(consumed.load(), CONSUMERS);
+    BOOST_CHECK_EQUAL(sum.load(), SUM);
+    BOOST_CHECK(q.was_empty());
+
+    // The producers suspend on the full queue, pop resumes them.
+    Queue q2;
+    produced = 0;
+    for(unsigned i = 0; i < PRODUCERS; ++i)
+        async_producer(q2, i * N, N, produced);
+    BOOST_CHECK_EQUAL(produced.load(), 0u);
+    BOOST_CHECK(q2.was_full());
+    uint64_t sum2 = 0;
+    for(unsigned i = 0; i < PRODUCERS * N; ++i)
+        sum2 += q2.pop();
+    BOOST_CHECK_EQUAL(produced.load(), PRODUCERS);
+    BOOST_CHECK_EQUAL(sum2, SUM);
+    BOOST_CHECK(q2.was_empty());
+}
+
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////